@@ -0,0 +1,245 @@
+/* BEGIN_COMMON_COPYRIGHT_HEADER
+ * (c)LGPL2+
+ *
+ *
+ * Copyright: 2012-2013 Boomaga team https://github.com/Boomaga
+ * Authors:
+ *   Alexander Sokoloff <sokoloff.a@gmail.com>
+ *
+ * This program or library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * END_COMMON_COPYRIGHT_HEADER */
+
+
+#include "batchrender.h"
+#include "render.h"
+#include "kernel/project.h"
+#include "kernel/layout.h"
+
+#include <QDir>
+#include <QTimer>
+#include <QDebug>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QRunnable>
+
+
+/************************************************
+ * The images are encoded in parallel,
+ * the render workers don't wait for it.
+ ************************************************/
+class SaveImageTask: public QRunnable
+{
+public:
+    SaveImageTask(const QImage &image, const QString &fileName, const QString &format, QAtomicInt *errors):
+        mImage(image),
+        mFileName(fileName),
+        mFormat(format),
+        mErrors(errors)
+    {
+    }
+
+    void run() override
+    {
+        if (!mImage.save(mFileName, mFormat.toLatin1().constData()))
+        {
+            qWarning() << "Can't write" << mFileName;
+            mErrors->ref();
+        }
+    }
+
+private:
+    QImage mImage;
+    QString mFileName;
+    QString mFormat;
+    QAtomicInt *mErrors;
+};
+
+
+/************************************************
+ *
+ ************************************************/
+BatchRender::BatchRender(const QString &outDir, double resolution, int threadCount, QObject *parent):
+    QObject(parent),
+    mOutDir(outDir),
+    mFormat("png"),
+    mRender(new Render(resolution, threadCount, this)),
+    mLoadTime(0),
+    mStarted(false),
+    mSheetCount(0),
+    mErrors(0)
+{
+    connect(project, SIGNAL(tmpFileRenamed(QString)),
+            this, SLOT(tmpFileRenamed(QString)));
+
+    connect(project, SIGNAL(errorOccurred(QString)),
+            this, SLOT(projectError(QString)));
+
+    connect(mRender, SIGNAL(sheetReady(QImage,int,QByteArray)),
+            this, SLOT(sheetReady(QImage,int)));
+}
+
+
+/************************************************
+ *
+ ************************************************/
+BatchRender::~BatchRender()
+{
+    QThreadPool::globalInstance()->waitForDone();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+QStringList BatchRender::layoutIds()
+{
+    QStringList res;
+    foreach (const Layout *layout, Layout::availableLayouts())
+        res << layout->id();
+
+    return res;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+bool BatchRender::start(const QStringList &files, const QString &layoutId)
+{
+    const Layout *layout = Layout::findLayout(layoutId);
+    if (!layout)
+    {
+        qWarning() << "Unknown layout" << layoutId;
+        return false;
+    }
+
+    if (!QDir().mkpath(mOutDir))
+    {
+        qWarning() << "Can't create directory" << mOutDir;
+        return false;
+    }
+
+    mTimer.start();
+    project->setLayout(layout);
+    return !project->load(files).isEmpty();
+}
+
+
+/************************************************
+ * The render starts when the temp file is complete,
+ * the big jobs are imported in the background.
+ ************************************************/
+void BatchRender::tmpFileRenamed(const QString &fileName)
+{
+    if (mStarted)
+        return;
+
+    mStarted = true;
+    mFileName = fileName;
+    QTimer::singleShot(0, this, SLOT(renderSheets()));
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void BatchRender::renderSheets()
+{
+    project->finishImport();
+    mLoadTime = mTimer.restart();
+
+    mSheetCount = project->previewSheetCount();
+    if (mSheetCount == 0)
+    {
+        finish();
+        return;
+    }
+
+    mRender->setGrayscale(project->printer()->grayscale());
+    mRender->setFileName(mFileName);
+
+    for (int i=0; i<mSheetCount; ++i)
+        mRender->renderSheet(i, Render::Thumbnail);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void BatchRender::sheetReady(const QImage &image, int sheetNum)
+{
+    if (mDone.contains(sheetNum))
+        return;
+
+    mDone << sheetNum;
+
+    if (image.isNull())
+    {
+        qWarning() << "Can't render sheet" << sheetNum + 1;
+        mErrors.ref();
+    }
+    else
+    {
+        QString fileName = QString("%1/sheet-%2.%3")
+                .arg(mOutDir)
+                .arg(sheetNum + 1, QString::number(mSheetCount).length(), 10, QChar('0'))
+                .arg(mFormat);
+
+        QThreadPool::globalInstance()->start(new SaveImageTask(image, fileName, mFormat, &mErrors));
+    }
+
+    if (mDone.count() == mSheetCount)
+        finish();
+}
+
+
+/************************************************
+ * The loading errors stop the batch,
+ * Project::error() has already logged them.
+ * The error can come from start(), before the event
+ * loop runs, so finished() is connected queued.
+ ************************************************/
+void BatchRender::projectError(const QString &message)
+{
+    Q_UNUSED(message)
+    mErrors.ref();
+
+    if (!mStarted)
+        emit finished(1);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void BatchRender::finish()
+{
+    QThreadPool::globalInstance()->waitForDone();
+    double time = mTimer.elapsed() / 1000.0;
+
+    QTextStream out(stdout);
+    out << QString("Loaded in %1 s").arg(mLoadTime / 1000.0, 0, 'f', 2) << endl;
+    out << QString("%1 sheets rendered in %2 s, %3 sheets/s at %4 dpi with %5 threads")
+           .arg(mSheetCount)
+           .arg(time, 0, 'f', 2)
+           .arg(time > 0 ? mSheetCount / time : 0, 0, 'f', 1)
+           .arg(mRender->resolution())
+           .arg(mRender->threadCount())
+        << endl;
+
+    emit finished(mErrors.load() ? 1 : 0);
+}
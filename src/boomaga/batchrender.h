@@ -0,0 +1,87 @@
+/* BEGIN_COMMON_COPYRIGHT_HEADER
+ * (c)LGPL2+
+ *
+ *
+ * Copyright: 2012-2013 Boomaga team https://github.com/Boomaga
+ * Authors:
+ *   Alexander Sokoloff <sokoloff.a@gmail.com>
+ *
+ * This program or library is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301 USA
+ *
+ * END_COMMON_COPYRIGHT_HEADER */
+
+
+#ifndef BATCHRENDER_H
+#define BATCHRENDER_H
+
+#include <QObject>
+#include <QImage>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QSet>
+
+class Render;
+class Layout;
+
+/************************************************
+ * Renders all the sheets of the files to the image
+ * files without the GUI, see the --render-sheets
+ * command line option.
+ ************************************************/
+class BatchRender: public QObject
+{
+    Q_OBJECT
+public:
+    BatchRender(const QString &outDir, double resolution, int threadCount = 0, QObject *parent = 0);
+    virtual ~BatchRender();
+
+    // "png" or "ppm"
+    QString format() const { return mFormat; }
+    void setFormat(const QString &value) { mFormat = value; }
+
+    // Returns false if the files can't be loaded,
+    // finished() is emitted when all sheets are saved.
+    // Connect finished() queued, it can be emitted by start().
+    bool start(const QStringList &files, const QString &layoutId);
+
+    static QStringList layoutIds();
+
+signals:
+    void finished(int exitCode);
+
+private slots:
+    void tmpFileRenamed(const QString &fileName);
+    void sheetReady(const QImage &image, int sheetNum);
+    void projectError(const QString &message);
+    void renderSheets();
+
+private:
+    QString mOutDir;
+    QString mFormat;
+    Render *mRender;
+    QString mFileName;
+    QElapsedTimer mTimer;
+    qint64 mLoadTime;
+    bool mStarted;
+    int mSheetCount;
+    QSet<int> mDone;
+    QAtomicInt mErrors;
+
+    void finish();
+};
+
+#endif // BATCHRENDER_H
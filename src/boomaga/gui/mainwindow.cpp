@@ -50,7 +50,9 @@
 #include <QMessageBox>
 #include <QPushButton>
 #include <QDir>
+#include <QFile>
 #include <QProcess>
+#include <QEventLoop>
 #include <QDebug>
 #include <QTimer>
 #include <QKeyEvent>
@@ -88,33 +90,13 @@ MainWindow::MainWindow(QWidget *parent):
     initStatusBar();
     initActions();
 
-    Layout *layout = new LayoutNUp(1, 1);
-    mAvailableLayouts << layout;
-    ui->layout1UpBtn->setLayout(layout);
-
-    layout = new LayoutNUp(2, 1);
-    mAvailableLayouts << layout;
-    ui->layout2UpBtn->setLayout(layout);
-
-    layout = new LayoutNUp(2, 2, Qt::Horizontal);
-    mAvailableLayouts << layout;
-    ui->layout4UpHorizBtn->setLayout(layout);
-
-    layout = new LayoutNUp(2, 2, Qt::Vertical);
-    mAvailableLayouts << layout;
-    ui->layout4UpVertBtn->setLayout(layout);
-
-    layout = new LayoutNUp(4, 2, Qt::Horizontal);
-    mAvailableLayouts << layout;
-    ui->layout8UpHorizBtn->setLayout(layout);
-
-    layout = new LayoutNUp(4, 2, Qt::Vertical);
-    mAvailableLayouts << layout;
-    ui->layout8UpVertBtn->setLayout(layout);
-
-    layout = new LayoutBooklet();
-    mAvailableLayouts << layout;
-    ui->layoutBookletBtn->setLayout(layout);
+    ui->layout1UpBtn->setLayout(Layout::findLayout("1up"));
+    ui->layout2UpBtn->setLayout(Layout::findLayout("2up"));
+    ui->layout4UpHorizBtn->setLayout(Layout::findLayout("4up"));
+    ui->layout4UpVertBtn->setLayout(Layout::findLayout("4upV"));
+    ui->layout8UpHorizBtn->setLayout(Layout::findLayout("8up"));
+    ui->layout8UpVertBtn->setLayout(Layout::findLayout("8upV"));
+    ui->layoutBookletBtn->setLayout(Layout::findLayout("Booklet"));
 
     loadSettings();
     fillPrintersCombo();
@@ -291,14 +273,12 @@ void MainWindow::loadSettings()
 
     QString layoutId = settings->value(Settings::Layout).toString();
 
-    foreach(Layout *layout, mAvailableLayouts)
-    {
-        if (layout->id() == layoutId)
-            project->setLayout(layout);
-    }
+    Layout *layout = Layout::findLayout(layoutId);
+    if (layout)
+        project->setLayout(layout);
 
     if (!project->layout())
-        project->setLayout(mAvailableLayouts.at(0));
+        project->setLayout(Layout::availableLayouts().first());
 
     project->setDoubleSided(settings->value(Settings::DoubleSided).toBool());
 
@@ -555,6 +535,44 @@ void MainWindow::switchPrinterProfile()
 }
 
 
+/************************************************
+ * Runs the event loop until lpr is finished,
+ * so the GUI is not blocked.
+ ************************************************/
+static void waitForPrintFile(QProcess *proc)
+{
+    if (proc->state() == QProcess::NotRunning)
+        return;
+
+    QEventLoop loop;
+    QObject::connect(proc, SIGNAL(finished(int,QProcess::ExitStatus)),
+                     &loop, SLOT(quit()));
+    loop.exec(QEventLoop::ExcludeUserInputEvents);
+}
+
+
+/************************************************
+ * The aborted first pass still reads the file,
+ * the file is removed when lpr is finished.
+ ************************************************/
+static void removeWhenFinished(QProcess *proc, const QString &fileName)
+{
+    if (proc->state() == QProcess::NotRunning)
+    {
+        delete proc;
+        QFile::remove(fileName);
+        return;
+    }
+
+    QObject::connect(proc, static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
+                     [proc, fileName]()
+    {
+        QFile::remove(fileName);
+        proc->deleteLater();
+    });
+}
+
+
 /************************************************
  *
  ************************************************/
@@ -672,6 +690,7 @@ bool MainWindow::print(uint count, bool collate)
              rotateSheets(keeper.sheets_2);
 
 
+         // Both passes should have the same number of sheets ......
          if (keeper.sheets_1.count())
          {
              if (order_1 == Project::BackOrder)
@@ -684,25 +703,66 @@ bool MainWindow::print(uint count, bool collate)
                  while (keeper.sheets_1.count() < keeper.sheets_2.count())
                      keeper.sheets_1.append(new Sheet(1, 0));
              }
+         }
+
+         if (keeper.sheets_2.count())
+         {
+             if (order_2 == Project::BackOrder)
+             {
+                 while (keeper.sheets_2.count() < keeper.sheets_1.count())
+                     keeper.sheets_2.insert(0, new Sheet(1, 0));
+             }
+             else
+             {
+                 while (keeper.sheets_2.count() < keeper.sheets_1.count())
+                     keeper.sheets_2.append(new Sheet(1, 0));
+             }
+         }
+         // ................................................
 
+         // The both passes are printed from one document, so the base
+         // of the temporary file is written to the disk only once.
+         // Each pass prints its own page range.
+         const int count_1 = keeper.sheets_1.count();
+         const int count_2 = keeper.sheets_2.count();
+         if (!count_1 && !count_2)
+             return true;
 
-             if (!keeper.sheets_2.count())
+         QString file = Printer::printFileName();
+         if (!project->writeDocument(keeper.sheets_1 + keeper.sheets_2, file))
+         {
+             QFile::remove(file);
+             return false;
+         }
+
+         // The first of the two passes is sent while the dialog below
+         // is shown, the file is removed by the second one.
+         QProcess *firstPass = 0;
+         if (count_1)
+         {
+             if (!count_2)
              {
                  infoDialog = showPrintDialog(tr("Print the all pages on %1.").arg(project->printer()->name()));
+                 res = project->printer()->printFile(file, 1, count_1, "", project->doubleSided(), count, collate, true);
+             }
+             else
+             {
+                 firstPass = project->printer()->startPrintFile(file, 1, count_1, "", project->doubleSided(), count, collate);
+                 res = firstPass->state() != QProcess::NotRunning || project->printer()->printFileFinished(firstPass);
              }
 
-
-             res = project->printer()->print(keeper.sheets_1, "", project->doubleSided(), count, collate);
              if (!res)
              {
                  delete(infoDialog);
+                 delete(firstPass);
+                 QFile::remove(file);
                  return false;
              }
          }
 
 
          // Show dialog ....................................
-         if (keeper.sheets_1.count() && keeper.sheets_2.count())
+         if (count_1 && count_2)
          {
              QMessageBox dialog(this);
              dialog.setWindowTitle(this->windowTitle() + " ");
@@ -719,31 +779,34 @@ bool MainWindow::print(uint count, bool collate)
              if (dialog.exec() != QMessageBox::Ok)
              {
                  delete(infoDialog);
+                 removeWhenFinished(firstPass, file);
+                 return false;
+             }
+
+             // lpr can still be reading the file for the first pass.
+             waitForPrintFile(firstPass);
+             if (!project->printer()->printFileFinished(firstPass))
+             {
+                 delete(infoDialog);
+                 delete(firstPass);
+                 QFile::remove(file);
                  return false;
              }
+
+             delete(firstPass);
          }
          // ................................................
 
 
-         if (keeper.sheets_2.count())
+         if (count_2)
          {
-             if (order_2 == Project::BackOrder)
-             {
-                 while (keeper.sheets_2.count() < keeper.sheets_1.count())
-                     keeper.sheets_2.insert(0, new Sheet(1, 0));
-             }
-             else
-             {
-                 while (keeper.sheets_2.count() < keeper.sheets_1.count())
-                     keeper.sheets_2.append(new Sheet(1, 0));
-             }
-
              infoDialog = showPrintDialog(tr("Print the even pages on %1.").arg(project->printer()->name()));
 
-             res = project->printer()->print(keeper.sheets_2, "", project->doubleSided(), count, collate);
+             res = project->printer()->printFile(file, count_1 + 1, count_1 + count_2, "", project->doubleSided(), count, collate, true);
              if (!res)
              {
                  delete(infoDialog);
+                 QFile::remove(file);
                  return false;
              }
          }
@@ -1164,7 +1227,7 @@ void MainWindow::rotateJobLeft()
         ProjectPage *page = job.page(i);
         page->setManualRotation(page->manualRotation() - Rotate90);
     }
-    project->update();
+    project->updateSheets();
 }
 
 
@@ -1183,7 +1246,7 @@ void MainWindow::rotateJobRight()
         ProjectPage *page = job.page(i);
         page->setManualRotation(page->manualRotation() + Rotate90);
     }
-    project->update();
+    project->updateSheets();
 }
 
 
@@ -1197,7 +1260,7 @@ void MainWindow::rotatePageLeft()
         return;
 
     act->page()->setManualRotation(act->page()->manualRotation() - Rotate90);
-    project->update();
+    project->updateSheets();
 }
 
 
@@ -1211,7 +1274,7 @@ void MainWindow::rotatePageRight()
         return;
 
     act->page()->setManualRotation(act->page()->manualRotation() + Rotate90);
-    project->update();
+    project->updateSheets();
 }
 
 
@@ -1225,7 +1288,7 @@ void MainWindow::startBooklet()
         return;
 
     act->page()->setManualStartSubBooklet(true);
-    project->update();
+    project->updateSheets();
 
     int sheetNum = project->previewSheets().indexOfPage(act->page());
     if (sheetNum > -1)
@@ -1243,7 +1306,7 @@ void MainWindow::dontStartBooklet()
         return;
 
     act->page()->setManualStartSubBooklet(false);
-    project->update();
+    project->updateSheets();
 
     int sheetNum = project->previewSheets().indexOfPage(act->page());
     if (sheetNum > -1)
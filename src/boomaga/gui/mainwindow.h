@@ -110,7 +110,6 @@ protected:
 private:
     Ui::MainWindow *ui;
 
-    QList<Layout*> mAvailableLayouts;
 
     QLabel mStatusBarSheetsLabel;
     QLabel mStatusBarCurrentSheetLabel;
@@ -27,7 +27,7 @@
 #ifndef JOBLISTVIEW_H
 #define JOBLISTVIEW_H
 
-#include <QListWidget>
+#include <QListView>
 #include <QContextMenuEvent>
 #include <QMouseEvent>
 #include <kernel/job.h>
@@ -31,6 +31,8 @@
 #include <QContextMenuEvent>
 #include <QMouseEvent>
 #include <QWheelEvent>
+#include <QToolTip>
+#include <QHelpEvent>
 #include <QDebug>
 #include <QPainter>
 #include <QBuffer>
@@ -39,13 +41,17 @@
 #include "boomagatypes.h"
 
 #define RESOLUTIN 30
-#define PAGE_NUM_ROLE           (Qt::UserRole + 1)
-#define TOOLTIP_TEMPLATE_ROLE   (Qt::UserRole + 2)
-#define PREVIEWPAGE_NUM_ROLE    (Qt::UserRole + 3)
 
 #define MIN_ICON_SIZE 32
 #define MAX_ICON_SIZE 200
 
+// The thumbnails are rendered for the rows this close to the viewport,
+// and dropped for the rows farther than EVICT_ROWS.
+#define PREFETCH_ROWS   10
+#define EVICT_ROWS      50
+
+#define ITEM_MARGIN     4
+
 #define TOOLTIP_HTML "<html>" \
     "<table border=0><tr>" \
         "<td><img height=200 src='%IMG%'></td>" \
@@ -62,19 +68,149 @@
     "}"
 
 
+/************************************************
+ *
+ ************************************************/
+PagesListModel::PagesListModel(QObject *parent):
+    QAbstractListModel(parent)
+{
+}
+
+
+/************************************************
+ *
+ ************************************************/
+int PagesListModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : mItems.count();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+QVariant PagesListModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= mItems.count())
+        return QVariant();
+
+    const Item &item = mItems.at(index.row());
+    switch (role)
+    {
+    case Qt::DisplayRole:
+        return item.title;
+
+    case Qt::DecorationRole:
+        return mIconRows.contains(index.row()) ? item.icon : mEmptyIcon;
+    }
+
+    return QVariant();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+Qt::ItemFlags PagesListModel::flags(const QModelIndex &index) const
+{
+    Qt::ItemFlags res = QAbstractListModel::flags(index) | Qt::ItemIsDropEnabled;
+    if (index.isValid())
+        res |= Qt::ItemIsDragEnabled;
+
+    return res;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+Qt::DropActions PagesListModel::supportedDropActions() const
+{
+    return Qt::MoveAction;
+}
+
+
+/************************************************
+ * The rows are updated in place, so the view keeps
+ * its scroll position and selection.
+ ************************************************/
+void PagesListModel::setItems(const QList<Item> &items)
+{
+    if (items.count() < mItems.count())
+    {
+        beginRemoveRows(QModelIndex(), items.count(), mItems.count() - 1);
+        mItems = items;
+        endRemoveRows();
+    }
+    else if (items.count() > mItems.count())
+    {
+        beginInsertRows(QModelIndex(), mItems.count(), items.count() - 1);
+        mItems = items;
+        endInsertRows();
+    }
+    else
+    {
+        mItems = items;
+    }
+
+    mIconRows.clear();
+    mRows.clear();
+    mRows.reserve(mItems.count());
+    for (int i=0; i<mItems.count(); ++i)
+    {
+        int page = mItems.at(i).page;
+        if (page > -1 && !mRows.contains(page))
+            mRows.insert(page, i);
+    }
+
+    if (!mItems.isEmpty())
+        emit dataChanged(index(0), index(mItems.count() - 1));
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PagesListModel::setIcon(int row, const QIcon &icon)
+{
+    mItems[row].icon = icon;
+    mIconRows << row;
+    emit dataChanged(index(row), index(row));
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PagesListModel::clearIcon(int row)
+{
+    mItems[row].icon = QIcon();
+    mIconRows.remove(row);
+    emit dataChanged(index(row), index(row));
+}
+
+
 /************************************************
  *
  ************************************************/
 PagesListView::PagesListView(QWidget *parent):
-    QListWidget(parent),
+    QListView(parent),
     mRender(new Render(RESOLUTIN)),
+    mModel(new PagesListModel(this)),
+    mToolTipPage(-1),
     mIconSize(64)
 {
+    setModel(mModel);
+    setUniformItemSizes(true);
+
     connect(project, SIGNAL(tmpFileRenamed(QString)),
             mRender, SLOT(setFileName(QString)));
 
-    connect(mRender, SIGNAL(pageReady(QImage,int)),
-            this, SLOT(previewRedy(QImage,int)));
+    connect(project, SIGNAL(tmpFileUpdated(QString)),
+            mRender, SLOT(reloadFile()));
+
+    connect(mRender, SIGNAL(pageReady(QImage,int,QByteArray)),
+            this, SLOT(previewRedy(QImage,int,QByteArray)));
 
     connect(project, SIGNAL(changed()),
             this, SLOT(updateItems()));
@@ -82,6 +218,12 @@ PagesListView::PagesListView(QWidget *parent):
     connect(project, SIGNAL(currentPageChanged(int)),
             this, SLOT(switchPageNum()));
 
+    mThumbnailsTimer.setSingleShot(true);
+    mThumbnailsTimer.setInterval(0);
+    connect(&mThumbnailsTimer, SIGNAL(timeout()),
+            this, SLOT(updateThumbnails()));
+
+    mRender->setThumbnailSize(MAX_ICON_SIZE);
     setIconSize(64);
 
     setStyleSheet(STYLE_SHEET);
@@ -102,57 +244,45 @@ PagesListView::~PagesListView()
 void PagesListView::setIconSize(int size)
 {
     mIconSize = qBound(MIN_ICON_SIZE, size, MAX_ICON_SIZE);
-    QListWidget::setIconSize(QSize(mIconSize, mIconSize));
+    QListView::setIconSize(QSize(mIconSize, mIconSize));
+    mThumbnailsTimer.start();
 }
 
 
 /************************************************
- *
+ * The thumbnails are requested later, only for
+ * the rows near the viewport. The images of the
+ * changed pages are already dropped from the
+ * ImageCache, see Project::pagesReplaced().
  ************************************************/
 void PagesListView::updateItems()
 {
-
-    QList<ItemInfo> pages = getPages();
-
-    setUpdatesEnabled(false);
-    while(this->count() > pages.count())
+    // The thumbnails are converted to grayscale by the render.
+    if (mRender->grayscale() != project->printer()->grayscale())
     {
-        delete takeItem(this->count()-1);
+        mRender->setGrayscale(project->printer()->grayscale());
+        ImageCache::instance()->clear(ImageCache::PageImage);
     }
 
-    for (int i=0; i<count(); ++i)
-    {
-        ItemInfo page = pages.at(i);
-        QListWidgetItem *item = this->item(i);
-        item->setText(page.title);
-        item->setData(PAGE_NUM_ROLE, page.page);
-        item->setData(PREVIEWPAGE_NUM_ROLE, project->previewPageNum(page.page));
-        item->setData(TOOLTIP_TEMPLATE_ROLE, page.toolTip);
-
-        if (page.page > -1)
-            mRender->renderPage(page.page);
-        else
-            item->setIcon(createIcon(QImage()));
-    }
+    mRequested.clear();
+    mToolTipPage = -1;
 
-    while(this->count() < pages.count())
+    QList<PagesListModel::Item> items;
+    foreach (const ItemInfo &page, getPages())
     {
-        ItemInfo page = pages.at(this->count());
-        QListWidgetItem *item = new QListWidgetItem(this);
-        item->setText(page.title);
-        item->setData(PAGE_NUM_ROLE, page.page);
-        item->setData(PREVIEWPAGE_NUM_ROLE, project->previewPageNum(page.page));
-        item->setData(TOOLTIP_TEMPLATE_ROLE, page.toolTip);
-
-        item->setIcon(createIcon(QImage()));
-        addItem(item);
-
-        if (page.page > -1)
-            mRender->renderPage(page.page);
+        PagesListModel::Item item;
+        item.title = page.title;
+        item.page = page.page;
+        item.previewPage = project->previewPageNum(page.page);
+        item.toolTip = page.toolTip;
+        items << item;
     }
 
+    mModel->setEmptyIcon(createIcon(QImage()));
+    mModel->setItems(items);
+
     switchPageNum();
-    setUpdatesEnabled(true);
+    mThumbnailsTimer.start();
 }
 
 
@@ -161,29 +291,130 @@ void PagesListView::updateItems()
  ************************************************/
 void PagesListView::switchPageNum()
 {
-    if (count() < 1)
+    int count = mModel->rowCount();
+    if (count < 1)
         return;
 
     int pageNum = project->currentPreviewPage();
 
     if (pageNum < 0)
     {
-        setCurrentRow(0);
+        setCurrentIndex(mModel->index(0));
         return;
     }
 
-    for (int i=count()-1; i>-1; --i)
+    for (int i=count-1; i>-1; --i)
     {
-        if (item(i)->data(PREVIEWPAGE_NUM_ROLE).toInt() <= pageNum)
+        if (mModel->item(i).previewPage <= pageNum)
         {
-            setCurrentRow(i);
+            setCurrentIndex(mModel->index(i));
             return;
         }
     }
 
-    setCurrentRow(0);
+    setCurrentIndex(mModel->index(0));
 }
 
+
+/************************************************
+ * The items have margins, so the second point
+ * is probed if the first one hits the gap.
+ ************************************************/
+void PagesListView::visibleRows(int *first, int *last) const
+{
+    const int x = ITEM_MARGIN * 2;
+    const int bottom = viewport()->height() - 1;
+
+    QModelIndex top = indexAt(QPoint(x, ITEM_MARGIN));
+    if (!top.isValid())
+        top = indexAt(QPoint(x, ITEM_MARGIN * 3));
+
+    QModelIndex btm = indexAt(QPoint(x, bottom - ITEM_MARGIN));
+    if (!btm.isValid())
+        btm = indexAt(QPoint(x, bottom - ITEM_MARGIN * 3));
+
+    *first = top.isValid() ? top.row() : 0;
+    *last  = btm.isValid() ? btm.row() : mModel->rowCount() - 1;
+
+    // The list is shorter than the viewport.
+    if (*last < *first)
+        *last = *first;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PagesListView::updateThumbnails()
+{
+    int count = mModel->rowCount();
+    if (count == 0)
+        return;
+
+    int first, last;
+    visibleRows(&first, &last);
+
+    int from = qMax(0, first - PREFETCH_ROWS);
+    int to   = qMin(count - 1, last + PREFETCH_ROWS);
+
+    ImageCache *cache = ImageCache::instance();
+    for (int row=from; row<=to; ++row)
+    {
+        int page = mModel->item(row).page;
+        if (page < 0 || mModel->hasIcon(row) || mRequested.contains(page))
+            continue;
+
+        QImage image = cache->image(ImageCache::PageImage, page, mRender->pageKey(page));
+        if (!image.isNull())
+        {
+            setThumbnail(row, image);
+        }
+        else
+        {
+            mRequested << page;
+            mRender->renderPage(page);
+        }
+    }
+
+    // Forget the rows far away from the viewport.
+    foreach (int page, mRequested)
+    {
+        int row = mModel->rowOfPage(page);
+        if (row < first - EVICT_ROWS || row > last + EVICT_ROWS)
+        {
+            mRender->cancelPage(page);
+            mRequested.remove(page);
+        }
+    }
+
+    foreach (int row, mModel->iconRows())
+    {
+        if (row < first - EVICT_ROWS || row > last + EVICT_ROWS)
+            mModel->clearIcon(row);
+    }
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PagesListView::resizeEvent(QResizeEvent *e)
+{
+    QListView::resizeEvent(e);
+    mThumbnailsTimer.start();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PagesListView::scrollContentsBy(int dx, int dy)
+{
+    QListView::scrollContentsBy(dx, dy);
+    mThumbnailsTimer.start();
+}
+
+
 /************************************************
  *
  ************************************************/
@@ -200,32 +431,78 @@ QString imageAsText(const QImage &image)
 /************************************************
  *
  ************************************************/
-void PagesListView::previewRedy(QImage image, int pageNum)
+void PagesListView::setThumbnail(int row, const QImage &image)
 {
-    for (int i=0; i<count(); ++i)
-    {
-        if (item(i)->data(PAGE_NUM_ROLE) == pageNum)
-        {
-            item(i)->setIcon(createIcon(image));
-
-            QString toolTip = item(i)->data(TOOLTIP_TEMPLATE_ROLE).toString();
-            if (toolTip.isEmpty())
-            {
-                item(i)->setToolTip("");
-            }
-            else
-            {
-                if (project->printer()->grayscale())
-                    image = toGrayscale(image);
-
-                item(i)->setToolTip(QString(TOOLTIP_HTML)
-                                .replace("%IMG%", imageAsText(image))
-                                .arg(toolTip));
-            }
+    mModel->setIcon(row, createIcon(image));
+}
 
-            return;
-        }
+
+/************************************************
+ * The image is encoded only for the hovered row,
+ * the last tooltip is kept while the mouse is over it.
+ ************************************************/
+QString PagesListView::toolTip(int row)
+{
+    const PagesListModel::Item &item = mModel->item(row);
+    if (item.toolTip.isEmpty() || item.page < 0)
+        return item.toolTip;
+
+    if (item.page == mToolTipPage)
+        return mToolTip;
+
+    QImage image = ImageCache::instance()->image(ImageCache::PageImage, item.page, mRender->pageKey(item.page));
+    if (image.isNull())
+        return item.toolTip;
+
+    mToolTipPage = item.page;
+    mToolTip = QString(TOOLTIP_HTML)
+            .replace("%IMG%", imageAsText(image))
+            .arg(item.toolTip);
+
+    return mToolTip;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+bool PagesListView::viewportEvent(QEvent *e)
+{
+    if (e->type() != QEvent::ToolTip)
+        return QListView::viewportEvent(e);
+
+    QHelpEvent *he = static_cast<QHelpEvent*>(e);
+    QModelIndex index = indexAt(he->pos());
+    if (!index.isValid())
+    {
+        QToolTip::hideText();
+        e->ignore();
+        return true;
     }
+
+    QToolTip::showText(he->globalPos(), toolTip(index.row()), viewport(), visualRect(index));
+    return true;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PagesListView::previewRedy(QImage image, int pageNum, const QByteArray &key)
+{
+    ImageCache::instance()->insert(ImageCache::PageImage, pageNum, image, key);
+
+    if (pageNum == mToolTipPage)
+        mToolTipPage = -1;
+
+    if (!mRequested.contains(pageNum))
+        return;
+
+    mRequested.remove(pageNum);
+
+    int row = mModel->rowOfPage(pageNum);
+    if (row > -1)
+        setThumbnail(row, image);
 }
 
 
@@ -238,9 +515,8 @@ void PagesListView::mouseReleaseEvent(QMouseEvent *e)
     if (n < 0)
         return;
 
-    bool ok;
-    int page = item(n)->data(PAGE_NUM_ROLE).toInt(&ok);
-    if (!ok || page < 0)
+    int page = mModel->item(n).page;
+    if (page < 0)
         return;
 
     emit pageSelected(page);
@@ -269,23 +545,25 @@ void PagesListView::wheelEvent(QWheelEvent *e)
     }
     else
     {
-        QListWidget::wheelEvent(e);
+        QListView::wheelEvent(e);
     }
 }
 
 
 /************************************************
- *
+ * The project is changed by itemMoved(),
+ * the rows are rebuilt by updateItems().
  ************************************************/
 void PagesListView::dropEvent(QDropEvent *e)
 {
-    int from = currentRow();
+    int from = currentIndex().row();
     if (from < 0)
     {
         e->ignore();
         return;
     }
 
+    int count = mModel->rowCount();
     int to = indexAt(e->pos()).row();
     if (dropIndicatorPosition() == QAbstractItemView::BelowItem)
     {
@@ -293,8 +571,8 @@ void PagesListView::dropEvent(QDropEvent *e)
     }
     else if (dropIndicatorPosition() == QAbstractItemView::OnViewport)
     {
-        if (e->pos().y() > visualItemRect(item(count()-1)).bottom())
-            to = count();
+        if (e->pos().y() > visualRect(mModel->index(count-1)).bottom())
+            to = count;
     }
 
     if (to > from)
@@ -308,7 +586,7 @@ void PagesListView::dropEvent(QDropEvent *e)
 
     }
 
-    QListWidget::dropEvent(e);
+    QListView::dropEvent(e);
     emit itemMoved(from, to);
 }
 
@@ -318,13 +596,7 @@ void PagesListView::dropEvent(QDropEvent *e)
  ************************************************/
 int PagesListView::indexOfPage(int pageNum) const
 {
-    for (int i=0; i<this->count(); ++i)
-    {
-        if (this->item(i)->data(PAGE_NUM_ROLE) == pageNum)
-            return i;
-
-    }
-    return -1;
+    return mModel->rowOfPage(pageNum);
 }
 
 
@@ -345,8 +617,6 @@ QIcon PagesListView::createIcon(const QImage &image) const
     else
     {
         img = image.scaled(MAX_ICON_SIZE, MAX_ICON_SIZE, Qt::KeepAspectRatio, Qt::SmoothTransformation);
-        if (project->printer()->grayscale())
-            img = toGrayscale(img);
     }
 
     QPainter painter(&img);
@@ -27,12 +27,61 @@
 #ifndef PAGELISTVIEW_H
 #define PAGELISTVIEW_H
 
-#include <QListWidget>
+#include <QListView>
+#include <QAbstractListModel>
+#include <QIcon>
+#include <QSet>
+#include <QHash>
+#include <QTimer>
 #include <kernel/job.h>
 
 class Render;
 
-class PagesListView: public QListWidget
+/************************************************
+ * The rows of the PagesListView, the thumbnails
+ * are set only for the rows near the viewport.
+ ************************************************/
+class PagesListModel: public QAbstractListModel
+{
+public:
+    struct Item
+    {
+        QString title;
+        int page;
+        int previewPage;
+        QString toolTip;        // The HTML text, see PagesListView::viewportEvent()
+        QIcon icon;
+    };
+
+    explicit PagesListModel(QObject *parent = 0);
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    Qt::ItemFlags flags(const QModelIndex &index) const override;
+    Qt::DropActions supportedDropActions() const override;
+
+    void setItems(const QList<Item> &items);
+    const Item &item(int row) const { return mItems.at(row); }
+
+    // The first row for the page, -1 if there is none.
+    int rowOfPage(int pageNum) const { return mRows.value(pageNum, -1); }
+
+    bool hasIcon(int row) const { return mIconRows.contains(row); }
+    void setIcon(int row, const QIcon &icon);
+    void clearIcon(int row);
+    QSet<int> iconRows() const { return mIconRows; }
+
+    void setEmptyIcon(const QIcon &icon) { mEmptyIcon = icon; }
+
+private:
+    QList<Item> mItems;
+    QHash<int, int> mRows;
+    QSet<int> mIconRows;
+    QIcon mEmptyIcon;
+};
+
+
+class PagesListView: public QListView
 {
      Q_OBJECT
 public:
@@ -60,18 +109,29 @@ protected:
     void mouseReleaseEvent(QMouseEvent *e);
     void wheelEvent(QWheelEvent *e);
     void dropEvent(QDropEvent *e);
+    void resizeEvent(QResizeEvent *e);
+    void scrollContentsBy(int dx, int dy);
+    bool viewportEvent(QEvent *e);
 
     int indexOfPage(int pageNum) const;
 
 private slots:
-    void previewRedy(QImage image, int pageNum);
+    void previewRedy(QImage image, int pageNum, const QByteArray &key);
     void switchPageNum();
+    void updateThumbnails();
 
 private:
     Render *mRender;
-    QImage mEmptyImage;
+    PagesListModel *mModel;
+    QSet<int> mRequested;
+    QTimer mThumbnailsTimer;
+    int mToolTipPage;
+    QString mToolTip;
 
     QIcon createIcon(const QImage &image) const;
+    void setThumbnail(int row, const QImage &image);
+    QString toolTip(int row);
+    void visibleRows(int *first, int *last) const;
     int mIconSize;
 };
 
@@ -35,14 +35,25 @@
 #include <QWheelEvent>
 #include <QDebug>
 #include <QRectF>
+#include <cmath>
 
 #define MARGIN_H        20
 #define MARGIN_V        20
 #define MARGIN_BOOKLET  4
 #define RESOLUTIN       150
 
-#define CACHE_PRE       10
-#define CACHE_POST      20
+// The preview is rendered at the screen resolution, rounded
+// to RESOLUTION_STEP to not render again for every resize.
+#define MIN_RESOLUTION  48
+#define MAX_RESOLUTION  600
+#define RESOLUTION_STEP 24
+
+#define MIN_PREFETCH    2
+#define MAX_PREFETCH    50
+// How long ahead of the scrolling the sheets are prefetched, in ms
+#define PREFETCH_TIME   1000
+
+//#define DEBUG_RENDER_TIME
 
 
 
@@ -51,10 +62,20 @@
  ************************************************/
 RenderCache::RenderCache(double resolution, int threadCount, QObject *parent):
     QObject(parent),
-    mRender(new Render(resolution, threadCount, this))
+    mRender(new Render(resolution, threadCount, this)),
+    mTimeToFirstPixel(-1),
+    mRenderTime(0),
+    mLastSheet(-1),
+    mLastSheetTime(0),
+    mVelocity(0)
 {
-    connect(mRender, SIGNAL(sheetReady(QImage,int)),
-            this, SLOT(onSheetReady(QImage,int)));
+    connect(mRender, SIGNAL(sheetReady(QImage,int,QByteArray)),
+            this, SLOT(onSheetReady(QImage,int,QByteArray)));
+
+    connect(mRender, SIGNAL(sheetDraftReady(QImage,int)),
+            this, SLOT(onSheetDraftReady(QImage,int)));
+
+    mClock.start();
 }
 
 
@@ -77,49 +98,164 @@ QString RenderCache::fileName() const
 
 
 /************************************************
- *
+ * The project updates the same file, the images of the
+ * changed sheets are dropped by ImageCache::replace().
+ * The image of the changed sheet missed by the project
+ * has the other key, see ImageCache.
  ************************************************/
 void RenderCache::setFileName(const QString &fileName)
 {
+    bool newFile = fileName != mRender->fileName();
     mRender->setFileName(fileName);
-    mItems.clear();
+    if (newFile)
+        ImageCache::instance()->clear(ImageCache::SheetImage);
+
+    mRequestTime.clear();
+    mVisibleRequestTime.clear();
+}
+
+
+/************************************************
+ * The images of the imported pages are replaced by
+ * the project, see Project::sheetsReplaced().
+ ************************************************/
+void RenderCache::reloadFile()
+{
+    mRender->reloadFile();
 }
 
 
 /************************************************
  *
  ************************************************/
-void RenderCache::renderSheet(int sheetNum)
+double RenderCache::resolution() const
 {
-    if (mItems.contains(sheetNum))
-        emit sheetReady(mItems.value(sheetNum), sheetNum);
-    else
-        mRender->renderSheet(sheetNum);
+    return mRender->resolution();
+}
+
+
+/************************************************
+ * The images at the old resolution are dropped.
+ ************************************************/
+void RenderCache::setResolution(double value)
+{
+    if (value == mRender->resolution())
+        return;
 
-    int start = qMax(0, sheetNum - CACHE_PRE);
-    int end = qMin(project->previewSheetCount()-1, sheetNum + CACHE_POST);
+    mRender->setResolution(value);
+    ImageCache::instance()->clear(ImageCache::SheetImage);
+    mRequestTime.clear();
+    mVisibleRequestTime.clear();
+}
 
-    for (int i=start; i<sheetNum; ++i)
+
+/************************************************
+ * The cached images are in the old color mode.
+ ************************************************/
+void RenderCache::setGrayscale(bool value)
+{
+    if (value == mRender->grayscale())
+        return;
+
+    mRender->setGrayscale(value);
+    ImageCache::instance()->clear(ImageCache::SheetImage);
+    mRequestTime.clear();
+    mVisibleRequestTime.clear();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void RenderCache::renderSheet(int sheetNum)
+{
+    ImageCache *cache = ImageCache::instance();
+    updateVelocity(sheetNum);
+
+    QImage img = cache->image(ImageCache::SheetImage, sheetNum, mRender->sheetKey(sheetNum));
+    if (!img.isNull())
     {
-        if (!mItems.contains(i))
-            mRender->renderSheet(i);
+        emit sheetReady(img, sheetNum);
+    }
+    else
+    {
+        if (!mVisibleRequestTime.contains(sheetNum))
+            mVisibleRequestTime.insert(sheetNum, mClock.elapsed());
+
+        request(sheetNum, Render::Visible);
     }
 
-    for (int i=sheetNum+1; i<=end; ++i)
+    // Prefetch more sheets in the scrolling direction.
+    int ahead  = prefetchCount();
+    int behind = qMax(MIN_PREFETCH, ahead / 4);
+    int dir    = mVelocity < 0 ? -1 : 1;
+    int last   = project->previewSheetCount() - 1;
+
+    for (int i=1; i<=qMax(ahead, behind); ++i)
     {
-        if (!mItems.contains(i))
-            mRender->renderSheet(i);
+        int n = sheetNum + dir * i;
+        if (i <= ahead && n >= 0 && n <= last &&
+            !cache->contains(ImageCache::SheetImage, n, mRender->sheetKey(n)))
+            request(n, Render::Prefetch);
+
+        n = sheetNum - dir * i;
+        if (i <= behind && n >= 0 && n <= last &&
+            !cache->contains(ImageCache::SheetImage, n, mRender->sheetKey(n)))
+            request(n, Render::Prefetch);
     }
+}
+
 
-    // Remove old values ........................
-    QHash<int, QImage>::iterator it = mItems.begin();
-    while (it != mItems.end())
+/************************************************
+ *
+ ************************************************/
+void RenderCache::request(int sheetNum, int priority)
+{
+    if (!mRequestTime.contains(sheetNum))
+        mRequestTime.insert(sheetNum, mClock.elapsed());
+
+    mRender->renderSheet(sheetNum, Render::Priority(priority));
+}
+
+
+/************************************************
+ * Scroll velocity in sheets per millisecond.
+ ************************************************/
+void RenderCache::updateVelocity(int sheetNum)
+{
+    qint64 now = mClock.elapsed();
+
+    if (mLastSheet > -1 && sheetNum != mLastSheet)
     {
-        if (it.key() < start || it.key() > end)
-            it = mItems.erase(it);
+        double v = double(sheetNum - mLastSheet) / qMax(qint64(1), now - mLastSheetTime);
+
+        if ((v < 0) != (mVelocity < 0))
+            mVelocity = v;
         else
-            ++it;
+            mVelocity = (mVelocity + v) / 2;
     }
+
+    mLastSheet = sheetNum;
+    mLastSheetTime = now;
+}
+
+
+/************************************************
+ * The sheets the user scrolls through while the
+ * prefetched sheets are rendered, but not more than
+ * half of the cache can hold.
+ ************************************************/
+int RenderCache::prefetchCount() const
+{
+    int res = MIN_PREFETCH + qAbs(mVelocity) * (PREFETCH_TIME + mRenderTime);
+    res = qMin(res, MAX_PREFETCH);
+
+    ImageCache *cache = ImageCache::instance();
+    qint64 imageSize = cache->averageSize(ImageCache::SheetImage);
+    if (imageSize)
+        res = qMin(res, int(cache->budget() / imageSize / 2));
+
+    return qMax(1, res);
 }
 
 
@@ -129,25 +265,69 @@ void RenderCache::renderSheet(int sheetNum)
 void RenderCache::cancelSheet(int sheetNum)
 {
     mRender->cancelSheet(sheetNum);
+    mRequestTime.remove(sheetNum);
 }
 
 
 /************************************************
  *
  ************************************************/
-void RenderCache::onSheetReady(const QImage &img, int sheetNum)
+void RenderCache::onSheetReady(const QImage &img, int sheetNum, const QByteArray &key)
 {
-    mItems.insert(sheetNum, img);
+    ImageCache::instance()->insert(ImageCache::SheetImage, sheetNum, img, key);
+
+    QHash<int, qint64>::iterator it = mRequestTime.find(sheetNum);
+    if (it != mRequestTime.end())
+    {
+        double time = mClock.elapsed() - it.value();
+        mRenderTime = mRenderTime ? mRenderTime * 0.8 + time * 0.2 : time;
+        mRequestTime.erase(it);
+
+#ifdef DEBUG_RENDER_TIME
+        qDebug() << "Sheet" << sheetNum << "rendered in" << time << "ms";
+#endif
+    }
+
+    firstPixel(sheetNum);
     emit sheetReady(img, sheetNum);
 }
 
 
+/************************************************
+ *
+ ************************************************/
+void RenderCache::onSheetDraftReady(const QImage &img, int sheetNum)
+{
+    firstPixel(sheetNum);
+    emit sheetDraftReady(img, sheetNum);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void RenderCache::firstPixel(int sheetNum)
+{
+    QHash<int, qint64>::iterator it = mVisibleRequestTime.find(sheetNum);
+    if (it == mVisibleRequestTime.end())
+        return;
+
+    mTimeToFirstPixel = mClock.elapsed() - it.value();
+    mVisibleRequestTime.erase(it);
+
+#ifdef DEBUG_RENDER_TIME
+    qDebug() << "Sheet" << sheetNum << "first pixel in" << mTimeToFirstPixel << "ms";
+#endif
+}
+
+
 
 /************************************************
 
  ************************************************/
 PreviewWidget::PreviewWidget(QWidget *parent) :
     QFrame(parent),
+    mDraft(false),
     mDisplayedSheetNum(-1),
     mScaleFactor(0),
     mWheelDelta(0)
@@ -160,13 +340,24 @@ PreviewWidget::PreviewWidget(QWidget *parent) :
     connect(project, SIGNAL(changed()),
             this, SLOT(refresh()));
 
-    mRender = new RenderCache(RESOLUTIN, 8, this);
+    mRender = new RenderCache(RESOLUTIN, 0, this);
 
     connect(project, SIGNAL(tmpFileRenamed(QString)),
             mRender, SLOT(setFileName(QString)));
 
+    connect(project, SIGNAL(tmpFileUpdated(QString)),
+            mRender, SLOT(reloadFile()));
+
     connect(mRender, SIGNAL(sheetReady(QImage,int)),
             this, SLOT(sheetImageReady(QImage,int)));
+
+    connect(mRender, SIGNAL(sheetDraftReady(QImage,int)),
+            this, SLOT(sheetDraftReady(QImage,int)));
+
+    mResolutionTimer.setSingleShot(true);
+    mResolutionTimer.setInterval(200);
+    connect(&mResolutionTimer, SIGNAL(timeout()),
+            this, SLOT(updateResolution()));
 }
 
 
@@ -374,13 +565,84 @@ void PreviewWidget::paintEvent(QPaintEvent *)
     if (mImage.isNull())
         return;
 
+    updateSheetPixmap();
+    if (mSheetPixmap.isNull())
+        return;
+
+    QPainter painter(this);
+    painter.drawPixmap(0, 0, mSheetPixmap);
+
+    // Draw current page rect ...................
+    Sheet *sheet = project->currentSheet();
+    if (sheet)
+    {
+        ProjectPage *curPage = project->currentPage();
+        if (curPage)
+        {
+            painter.save();
+            QPen pen = painter.pen();
+            pen.setStyle(Qt::DashLine);
+            //pen.setColor(QColor(142, 188, 226, 128));
+            pen.setColor(QColor(105, 101, 98, 70));
+            painter.setPen(pen);
+            painter.drawRect(this->pageRect(sheet->indexOfPage(curPage)));
+            painter.restore();
+        }
+    }
+
+//#define DEBUG_CLICK_RECT
+#ifdef DEBUG_CLICK_RECT
+    {
+        Sheet *sheet = project->currentSheet();
+        if (sheet)
+        {
+            ProjectPage *curPage = project->currentPage();
+            painter.save();
+            for (int i=0; i< sheet->count(); ++i)
+            {
+                QPen pen = painter.pen();
+                pen.setStyle(Qt::DotLine);
+                if (sheet->page(i) == curPage)
+                    pen.setColor(Qt::red);
+                else
+                    pen.setColor(QColor(142, 188, 226));
+                painter.setPen(pen);
+                painter.drawRect(this->pageRect(i));
+                painter.drawText(this->pageRect(i).translated(10, 10), QString("%1").arg(i));
+            }
+            painter.restore();
+        }
+    }
+#endif
+}
+
+
+/************************************************
+ * The scaled sheet with its shadow. It is drawn again only
+ * when the image, the widget size or the hints are changed.
+ ************************************************/
+void PreviewWidget::updateSheetPixmap()
+{
     QSizeF printerSize =  project->printer()->paperRect().size();
     Rotation rotation = project->rotation();
-    bool grayscale = project->printer()->grayscale();
 
     if (isLandscape(rotation))
         printerSize.transpose();
 
+    SheetPixmapKey key;
+    key.image = mImage.cacheKey();
+    key.size = size();
+    key.devicePixelRatio = devicePixelRatioF();
+    key.hints = int(mHints);
+    key.rotation = rotation;
+    key.paperSize = printerSize;
+
+    if (key == mSheetPixmapKey)
+        return;
+
+    mSheetPixmapKey = key;
+    mSheetPixmap = QPixmap();
+
     mScaleFactor = qMin((this->geometry().width()  - 2.0 * MARGIN_H) * 1.0 / printerSize.width(),
                         (this->geometry().height() - 2.0 * MARGIN_V) * 1.0 / printerSize.height());
 
@@ -422,12 +684,14 @@ void PreviewWidget::paintEvent(QPaintEvent *)
     }
 
 
-    QImage img = mImage.scaled(mDrawRect.size(), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-    if (grayscale)
-        img = toGrayscale(img);
+    QImage img = mImage.scaled(mDrawRect.size() * key.devicePixelRatio, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+    mSheetPixmap = QPixmap(key.size * key.devicePixelRatio);
+    mSheetPixmap.setDevicePixelRatio(key.devicePixelRatio);
+    mSheetPixmap.fill(Qt::transparent);
 
     // Draw .....................................
-    QPainter painter(this);
+    QPainter painter(&mSheetPixmap);
     painter.save();
     QPoint center = QRect(0, 0, geometry().width(), geometry().height()).center();
     painter.translate(center);
@@ -485,51 +749,23 @@ void PreviewWidget::paintEvent(QPaintEvent *)
     }
 
     painter.restore();
+    painter.end();
 
     mDrawRect.moveCenter(center);
+}
 
-    // Draw current page rect ...................
-    Sheet *sheet = project->currentSheet();
-    if (sheet)
-    {
-        ProjectPage *curPage = project->currentPage();
-        if (curPage)
-        {
-            painter.save();
-            QPen pen = painter.pen();
-            pen.setStyle(Qt::DashLine);
-            //pen.setColor(QColor(142, 188, 226, 128));
-            pen.setColor(QColor(105, 101, 98, 70));
-            painter.setPen(pen);
-            painter.drawRect(this->pageRect(sheet->indexOfPage(curPage)));
-            painter.restore();
-        }
-    }
 
-//#define DEBUG_CLICK_RECT
-#ifdef DEBUG_CLICK_RECT
-    {
-        Sheet *sheet = project->currentSheet();
-        if (sheet)
-        {
-            ProjectPage *curPage = project->currentPage();
-            painter.save();
-            for (int i=0; i< sheet->count(); ++i)
-            {
-                QPen pen = painter.pen();
-                pen.setStyle(Qt::DotLine);
-                if (sheet->page(i) == curPage)
-                    pen.setColor(Qt::red);
-                else
-                    pen.setColor(QColor(142, 188, 226));
-                painter.setPen(pen);
-                painter.drawRect(this->pageRect(i));
-                painter.drawText(this->pageRect(i).translated(10, 10), QString("%1").arg(i));
-            }
-            painter.restore();
-        }
-    }
-#endif
+/************************************************
+ *
+ ************************************************/
+bool PreviewWidget::SheetPixmapKey::operator==(const SheetPixmapKey &other) const
+{
+    return image == other.image &&
+           size == other.size &&
+           devicePixelRatio == other.devicePixelRatio &&
+           hints == other.hints &&
+           rotation == other.rotation &&
+           paperSize == other.paperSize;
 }
 
 
@@ -543,6 +779,7 @@ void PreviewWidget::sheetImageReady(const QImage &image, int sheetNum)
         sheetNum <= qMax(mDisplayedSheetNum, curSheet))
     {
         mImage = image;
+        mDraft = false;
         mDisplayedSheetNum = sheetNum;
         mHints = mRequests.value(sheetNum);
         update();
@@ -551,11 +788,75 @@ void PreviewWidget::sheetImageReady(const QImage &image, int sheetNum)
 }
 
 
+/************************************************
+ * The draft is shown until the sheet is rendered.
+ ************************************************/
+void PreviewWidget::sheetDraftReady(const QImage &image, int sheetNum)
+{
+    if (sheetNum != project->currentSheetNum())
+        return;
+
+    if (sheetNum == mDisplayedSheetNum && !mDraft)
+        return;
+
+    mImage = image;
+    mDraft = true;
+    mDisplayedSheetNum = sheetNum;
+    mHints = mRequests.value(sheetNum);
+    update();
+}
+
+
+/************************************************
+
+ ************************************************/
+void PreviewWidget::resizeEvent(QResizeEvent *event)
+{
+    QFrame::resizeEvent(event);
+    mResolutionTimer.start();
+}
+
+
+/************************************************
+ * Renders the sheets in the device pixels of the
+ * preview, not scaled from the fixed resolution.
+ ************************************************/
+void PreviewWidget::updateResolution()
+{
+    QSizeF printerSize =  project->printer()->paperRect().size();
+    if (isLandscape(project->rotation()))
+        printerSize.transpose();
+
+    if (printerSize.isEmpty())
+        return;
+
+    double scale = qMin((width()  - 2.0 * MARGIN_H) / printerSize.width(),
+                        (height() - 2.0 * MARGIN_V) / printerSize.height());
+
+    if (scale <= 0)
+        return;
+
+    double resolution = scale * 72.0 * devicePixelRatioF();
+    resolution = qBound(double(MIN_RESOLUTION),
+                        ceil(resolution / RESOLUTION_STEP) * RESOLUTION_STEP,
+                        double(MAX_RESOLUTION));
+
+    if (resolution != mRender->resolution())
+    {
+        mRender->setResolution(resolution);
+        refresh();
+    }
+}
+
+
 /************************************************
 
  ************************************************/
 void PreviewWidget::refresh()
 {
+    mResolutionTimer.start();
+    mRender->setGrayscale(project->printer()->grayscale());
+
     Sheet *sheet = project->currentSheet();
     if (!sheet)
     {
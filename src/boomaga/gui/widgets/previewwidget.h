@@ -31,6 +31,9 @@
 #include <QFrame>
 #include "kernel/sheet.h"
 #include <QHash>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QPixmap>
 
 class Render;
 
@@ -38,24 +41,46 @@ class RenderCache: public QObject
 {
     Q_OBJECT
 public:
-    RenderCache(double resolution, int threadCount = 8, QObject *parent = 0);
+    RenderCache(double resolution, int threadCount = 0, QObject *parent = 0);
     ~RenderCache();
     QString fileName() const;
+    double resolution() const;
 
 public slots:
     void setFileName(const QString &fileName);
+    void reloadFile();
+    void setResolution(double value);
+    void setGrayscale(bool value);
     void renderSheet(int sheetNum);
     void cancelSheet(int sheetNum);
 
+    // The time from the request of the visible sheet to its first
+    // image, draft or final, in ms. -1 if nothing was measured.
+    int timeToFirstPixel() const { return mTimeToFirstPixel; }
+
 signals:
     void sheetReady(QImage img, int sheetNum);
+    void sheetDraftReady(QImage img, int sheetNum);
 
 private slots:
-    void onSheetReady(const QImage &img, int sheetNum);
+    void onSheetReady(const QImage &img, int sheetNum, const QByteArray &key);
+    void onSheetDraftReady(const QImage &img, int sheetNum);
 
 private:
-    QHash<int, QImage> mItems;
     Render *mRender;
+    QElapsedTimer mClock;
+    QHash<int, qint64> mRequestTime;
+    QHash<int, qint64> mVisibleRequestTime;
+    int mTimeToFirstPixel;
+    double mRenderTime;
+    int mLastSheet;
+    qint64 mLastSheetTime;
+    double mVelocity;
+
+    void request(int sheetNum, int priority);
+    void updateVelocity(int sheetNum);
+    void firstPixel(int sheetNum);
+    int prefetchCount() const;
 };
 
 class PreviewWidget : public QFrame
@@ -81,12 +106,16 @@ protected:
     void keyPressEvent(QKeyEvent *event);
     void contextMenuEvent(QContextMenuEvent *event);
     void mousePressEvent(QMouseEvent *event);
+    void resizeEvent(QResizeEvent *event);
 
 private slots:
     void sheetImageReady(const QImage &image, int sheetNum);
+    void updateResolution();
+    void sheetDraftReady(const QImage &image, int sheetNum);
 
 private:
     QImage mImage;
+    bool mDraft;
     QRect mDrawRect;
     int mDisplayedSheetNum;
     double mScaleFactor;
@@ -94,8 +123,27 @@ private:
     QHash<int, Sheet::Hints> mRequests;
     RenderCache *mRender;
     int mWheelDelta;
+    QTimer mResolutionTimer;
+
+    struct SheetPixmapKey
+    {
+        SheetPixmapKey(): image(0), devicePixelRatio(0), hints(0), rotation(NoRotate) {}
+
+        qint64 image;
+        QSize size;
+        qreal devicePixelRatio;
+        int hints;
+        Rotation rotation;
+        QSizeF paperSize;
+
+        bool operator==(const SheetPixmapKey &other) const;
+    };
+
+    QPixmap mSheetPixmap;
+    SheetPixmapKey mSheetPixmapKey;
 
     void drawShadow(QPainter &painter, const QRectF &rect);
+    void updateSheetPixmap();
 };
 
 #endif // PREVIEWWIDGET_H
@@ -41,17 +41,17 @@ PdfFile::PdfFile(QObject *parent) :
  ************************************************/
 void PdfFile::read()
 {
-    PDF::Reader reader;
     try
     {
-        reader.open(mFileName, mStartPos, mEndPos);
+        // The reader is shared with the PdfProcessor which will merge the job.
+        QSharedPointer<PDF::Reader> reader = PDF::Reader::shared(mFileName, mStartPos, mEndPos);
 
         Job job;
         job.setFileName(mFileName);
         job.setFilePos(mStartPos, mEndPos);
-        job.setTitle(reader.find("/Trailer/Info/Title").asString().value());
+        job.setTitle(reader->find("/Trailer/Info/Title").asString().value());
 
-        int pageCount = reader.pageCount();
+        int pageCount = reader->pageCount();
         for (int i=0; i< pageCount; ++i)
         {
             job.addPage(new ProjectPage(i));
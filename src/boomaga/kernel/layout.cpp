@@ -35,6 +35,51 @@
 #include "math.h"
 
 #include <QDebug>
+
+
+/************************************************
+ * Translate(-pageRect.topLeft) * Scale * Rotate * Translate(dx, dy)
+ * multiplied into one matrix.
+ ************************************************/
+QTransform TransformSpec::pageMatrix(const QRectF &pageRect, const QRectF &paperRect) const
+{
+    double dx = 0;
+    double dy = 0;
+    QTransform rotate;
+
+    switch (rotation)
+    {
+    case NoRotate:
+        dx = rect.left();
+        dy = paperRect.height() - rect.bottom();
+        break;
+
+    case Rotate90:
+        dx = rect.left();
+        dy = paperRect.height() - rect.top();
+        rotate.setMatrix(0, -1, 0,  1, 0, 0,  0, 0, 1);
+        break;
+
+    case Rotate180:
+        dx = rect.right();
+        dy = paperRect.height() - rect.top();
+        rotate.setMatrix(-1, 0, 0,  0, -1, 0,  0, 0, 1);
+        break;
+
+    case Rotate270:
+        dx = rect.right();
+        dy = paperRect.height() - rect.bottom();
+        rotate.setMatrix(0, 1, 0,  -1, 0, 0,  0, 0, 1);
+        break;
+    }
+
+    return QTransform::fromTranslate(-pageRect.left(), -pageRect.top()) *
+           QTransform::fromScale(scale, scale) *
+           rotate *
+           QTransform::fromTranslate(dx, dy);
+}
+
+
 /************************************************
 
  ************************************************/
@@ -51,6 +96,55 @@ Layout::~Layout()
 }
 
 
+/************************************************
+ *
+ ************************************************/
+class LayoutRegistry: public QList<Layout*>
+{
+public:
+    LayoutRegistry()
+    {
+        *this << new LayoutNUp(1, 1);
+        *this << new LayoutNUp(2, 1);
+        *this << new LayoutNUp(2, 2, Qt::Horizontal);
+        *this << new LayoutNUp(2, 2, Qt::Vertical);
+        *this << new LayoutNUp(4, 2, Qt::Horizontal);
+        *this << new LayoutNUp(4, 2, Qt::Vertical);
+        *this << new LayoutBooklet();
+    }
+
+    ~LayoutRegistry()
+    {
+        qDeleteAll(*this);
+    }
+};
+
+
+/************************************************
+ *
+ ************************************************/
+QList<Layout *> Layout::availableLayouts()
+{
+    static LayoutRegistry layouts;
+    return layouts;
+}
+
+
+/************************************************
+ * Returns 0 if there is no layout with this id.
+ ************************************************/
+Layout *Layout::findLayout(const QString &id)
+{
+    foreach (Layout *layout, availableLayouts())
+    {
+        if (layout->id() == id)
+            return layout;
+    }
+
+    return 0;
+}
+
+
 /************************************************
 
  ************************************************/
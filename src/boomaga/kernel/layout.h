@@ -30,6 +30,7 @@
 #include <QList>
 #include <QRectF>
 #include <QString>
+#include <QTransform>
 #include "boomagatypes.h"
 #include "projectpage.h"
 
@@ -42,6 +43,10 @@ public:
     QRectF rect;
     Rotation rotation;
     double scale;
+
+    // Maps the PDF coordinates of the page with the pageRect
+    // box to the PDF coordinates of the sheet.
+    QTransform pageMatrix(const QRectF &pageRect, const QRectF &paperRect) const;
 };
 
 class Layout
@@ -50,6 +55,11 @@ public:
     Layout();
     virtual ~Layout();
 
+    // The layouts shared by the GUI and the batch mode,
+    // they are deleted when the application exits.
+    static QList<Layout*> availableLayouts();
+    static Layout *findLayout(const QString &id);
+
     virtual QString id() const = 0;
 
     virtual int calcSheetCount() const = 0;
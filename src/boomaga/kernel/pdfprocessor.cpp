@@ -41,7 +41,8 @@ PdfProcessor::PdfProcessor(const QString &fileName, qint64 startPos, qint64 endP
     mStartPos(startPos),
     mEndPos(endPos),
     mObjNumOffset(0),
-    mWriter(nullptr)
+    mWriter(nullptr),
+    mCancelFlag(nullptr)
 {
 
 }
@@ -60,7 +61,7 @@ PdfProcessor::~PdfProcessor()
  ************************************************/
 void PdfProcessor::open()
 {
-    mReader.open(mFileName, mStartPos, mEndPos);
+    mReader = PDF::Reader::shared(mFileName, mStartPos, mEndPos);
 }
 
 
@@ -69,7 +70,7 @@ void PdfProcessor::open()
  ************************************************/
 quint32 PdfProcessor::pageCount()
 {
-    return mReader.pageCount();
+    return mReader->pageCount();
 }
 
 
@@ -78,18 +79,43 @@ quint32 PdfProcessor::pageCount()
  ************************************************/
 void PdfProcessor::run(PDF::Writer *writer, quint32 objNumOffset)
 {
-    mWriter = writer;
+    readPages(objNumOffset);
+
+    for (int i=0; i<mPages.count() && !isCanceled(); ++i)
+        writePage(writer, i);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PdfProcessor::readPages(quint32 objNumOffset)
+{
     mObjNumOffset = objNumOffset;
 
-    PDF::Object catalog = mReader.getObject(mReader.trailerDict().value("Root").asLink());
-    PDF::Object pages   = mReader.getObject(catalog.dict().value("Pages").asLink());
+    PDF::Object catalog = mReader->getObject(mReader->trailerDict().value("Root").asLink());
+    PDF::Object pages   = mReader->getObject(catalog.dict().value("Pages").asLink());
 
-    mPageInfo.reserve(pages.dict().value("Count").asNumber().value());
+    int count = pages.dict().value("Count").asNumber().value();
+    mPageInfo.reserve(count);
+    mPages.reserve(count);
 
     PDF::Dict dict;
     walkPageTree(0, pages, dict);
+}
+
 
-    writer = nullptr;
+/************************************************
+ *
+ ************************************************/
+void PdfProcessor::writePage(PDF::Writer *writer, int pageNum)
+{
+    mWriter = writer;
+    const PageRef &ref = mPages.at(pageNum);
+    writePageAsXObject(ref.page, ref.inherited);
+    mWriter = nullptr;
+
+    emit pageReady();
 }
 
 
@@ -152,9 +178,9 @@ int PdfProcessor::walkPageTree(int pageNum, const PDF::Object &page, const PDF::
             dict.insert("Rotate",    pageDict.value("Rotate"));
 
         const PDF::Array kids = pageDict.value("Kids").asArray();
-        for (int i=0; i<kids.count(); ++i)
+        for (int i=0; i<kids.count() && !isCanceled(); ++i)
         {
-            pageNum = walkPageTree(pageNum, mReader.getObject(kids.at(i).asLink()), dict);
+            pageNum = walkPageTree(pageNum, mReader->getObject(kids.at(i).asLink()), dict);
         }
         return pageNum;
     }
@@ -172,9 +198,12 @@ int PdfProcessor::walkPageTree(int pageNum, const PDF::Object &page, const PDF::
             throw QString("Error on page %1 %2: %3").arg(page.objNum()).arg(page.genNum()).arg(err);
         }
 
-        pageInfo.xObjNums << writePageAsXObject(page, inherited);
+        // writePageAsXObject() keeps the page object number
+        pageInfo.xObjNums << page.objNum() + mObjNumOffset;
         mPageInfo << pageInfo;
-        emit pageReady();
+
+        PageRef ref = { page, inherited };
+        mPages << ref;
 
         return pageNum + 1;
     }
@@ -276,7 +305,7 @@ PDF::ObjNum PdfProcessor::writePageAsXObject(const PDF::Object &page, const PDF:
         if (!ok)
             throw QString("Page %1 %2 has incorrect content type.").arg(page.objNum()).arg(page.genNum());
 
-        content = mReader.getObject(link);
+        content = mReader->getObject(link);
         v = content.value();
     }
 
@@ -301,7 +330,7 @@ PDF::ObjNum PdfProcessor::writePageAsXObject(const PDF::Object &page, const PDF:
         QByteArray stream;
         for (int i=0; i<arr.count(); ++i)
         {
-            PDF::Object content = mReader.getObject(arr.at(i).asLink());
+            PDF::Object content = mReader->getObject(arr.at(i).asLink());
             stream.append(content.decodedStream());
         }
 
@@ -343,7 +372,7 @@ void PdfProcessor::offsetValue(PDF::Value &value)
         if (!mProcessedObjects.contains(link.objNum()))
         {
             mProcessedObjects << link.objNum();
-            PDF::Object obj = mReader.getObject(link);
+            PDF::Object obj = mReader->getObject(link);
             addOffset(obj);
         }
         link.setObjNum(link.objNum() + mObjNumOffset);
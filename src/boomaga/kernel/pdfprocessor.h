@@ -31,8 +31,10 @@
 #include <QString>
 #include <QFile>
 #include <QSet>
+#include <QAtomicInt>
 #include "pdfparser/pdfvalue.h"
 #include "pdfparser/pdfreader.h"
+#include "pdfparser/pdfobject.h"
 #include "boomagatypes.h"
 
 namespace  PDF {
@@ -54,6 +56,17 @@ public:
 
     void run(PDF::Writer *writer, quint32 objNumOffset);
 
+    // Reads the page tree without writing anything, the pageInfo()
+    // is valid after this call. The pages are written by writePage().
+    void readPages(quint32 objNumOffset);
+    void writePage(PDF::Writer *writer, int pageNum);
+
+    // All the objects are written with numbers up to maxObjNum() + objNumOffset.
+    quint32 maxObjNum() const { return mReader->xRefTable().maxObjNum(); }
+
+    // run() stops after the current page when the flag is set.
+    void setCancelFlag(const QAtomicInt *flag) { mCancelFlag = flag; }
+
     const QVector<PdfPageInfo> &pageInfo() const { return mPageInfo; }
 
 
@@ -64,12 +77,22 @@ private:
     QString mFileName;
     qint64 mStartPos;
     qint64 mEndPos;
-    PDF::Reader mReader;
+    QSharedPointer<PDF::Reader> mReader;
     quint32 mObjNumOffset;
     PDF::Writer *mWriter;
     QVector<PdfPageInfo> mPageInfo;
     QSet<PDF::ObjNum> mProcessedObjects;
 
+    struct PageRef
+    {
+        PDF::Object page;
+        PDF::Dict inherited;
+    };
+    QVector<PageRef> mPages;
+    const QAtomicInt *mCancelFlag;
+
+    bool isCanceled() const { return mCancelFlag && mCancelFlag->load(); }
+
     int walkPageTree(int pageNum, const PDF::Object &page, const PDF::Dict &inherited);
     PDF::ObjNum writePageAsXObject(const PDF::Object &page, const PDF::Dict &inherited);
     PDF::Object &addOffset(PDF::Object &obj);
@@ -30,10 +30,14 @@
 #include "layout.h"
 
 #include <QProcess>
+#include <QScopedPointer>
 #include <QSharedData>
 #include <QDebug>
 #include <QDir>
 #include <QTemporaryFile>
+#include <QElapsedTimer>
+#include <QCoreApplication>
+#include <cups/cups.h>
 
 #define A4_HEIGHT_MM    297
 #define A4_HEIGHT_PT    842
@@ -43,6 +47,187 @@
 #define MM_TO_PT    (A4_HEIGHT_PT * 1.0 / A4_HEIGHT_MM)
 #define PT_TO_MM    (A4_HEIGHT_MM * 1.0 / A4_HEIGHT_PT)
 
+// The events are processed while the job is sent, in ms
+#define PROCESS_EVENTS_TIME 100
+
+
+/************************************************
+ * Write-only device which sends the document to
+ * the CUPS scheduler as it is written.
+ ************************************************/
+class CupsJobStream: public QIODevice
+{
+public:
+    CupsJobStream();
+    ~CupsJobStream();
+
+    bool start(const QString &printerName, const QString &jobName, int numCopies, const QStringList &options);
+    bool finish();
+    void cancel();
+
+    bool isSequential() const { return true; }
+
+    // The PDF writer takes xref offsets from pos().
+    qint64 pos() const { return mWritten; }
+
+protected:
+    qint64 readData(char *, qint64) { return -1; }
+    qint64 writeData(const char *data, qint64 len);
+
+private:
+    QByteArray mPrinterName;
+    int mJobId;
+    qint64 mWritten;
+    QElapsedTimer mEventsTimer;
+};
+
+
+/************************************************
+
+ ************************************************/
+CupsJobStream::CupsJobStream():
+    QIODevice(),
+    mJobId(0),
+    mWritten(0)
+{
+}
+
+
+/************************************************
+
+ ************************************************/
+CupsJobStream::~CupsJobStream()
+{
+    cancel();
+}
+
+
+/************************************************
+
+ ************************************************/
+bool CupsJobStream::start(const QString &printerName, const QString &jobName, int numCopies, const QStringList &options)
+{
+    // The printer name can be "printer/instance", the scheduler
+    // knows only the printer, the instance is a set of options.
+    QByteArray name = printerName.toLocal8Bit();
+    QByteArray instance;
+    int slash = name.indexOf('/');
+    if (slash > -1)
+    {
+        instance = name.mid(slash + 1);
+        name.truncate(slash);
+    }
+
+    cups_dest_t *dests = 0;
+    int numDests = cupsGetDests(&dests);
+    cups_dest_t *dest = cupsGetDest(name.data(), instance.isEmpty() ? 0 : instance.data(), numDests, dests);
+    if (!dest)
+    {
+        cupsFreeDests(numDests, dests);
+        return false;
+    }
+
+    mPrinterName = dest->name;
+
+    // The options are added one by one, so the values can contain spaces.
+    cups_option_t *opts = 0;
+    int numOpts = 0;
+    for (int i=0; i<dest->num_options; ++i)
+        numOpts = cupsAddOption(dest->options[i].name, dest->options[i].value, numOpts, &opts);
+
+    cupsFreeDests(numDests, dests);
+
+    foreach (const QString &opt, options)
+    {
+        int n = opt.indexOf('=');
+        QByteArray optName  = (n < 0 ? opt : opt.left(n)).toLocal8Bit();
+        QByteArray optValue = n < 0 ? QByteArray("true") : opt.mid(n + 1).toLocal8Bit();
+        numOpts = cupsAddOption(optName.data(), optValue.data(), numOpts, &opts);
+    }
+
+    numOpts = cupsAddOption("copies", QByteArray::number(numCopies).data(), numOpts, &opts);
+
+    QByteArray title = jobName.toLocal8Bit();
+    mJobId = cupsCreateJob(CUPS_HTTP_DEFAULT, mPrinterName.data(), title.data(), numOpts, opts);
+    cupsFreeOptions(numOpts, opts);
+
+    if (!mJobId)
+        return false;
+
+    if (cupsStartDocument(CUPS_HTTP_DEFAULT, mPrinterName.data(), mJobId, title.data(), CUPS_FORMAT_PDF, 1) != HTTP_STATUS_CONTINUE)
+    {
+        cupsCancelJob2(CUPS_HTTP_DEFAULT, mPrinterName.data(), mJobId, 0);
+        mJobId = 0;
+        return false;
+    }
+
+    mWritten = 0;
+    mEventsTimer.start();
+    return open(QIODevice::WriteOnly);
+}
+
+
+/************************************************
+
+ ************************************************/
+bool CupsJobStream::finish()
+{
+    if (!mJobId)
+        return false;
+
+    close();
+    ipp_status_t status = cupsFinishDocument(CUPS_HTTP_DEFAULT, mPrinterName.data());
+    mJobId = 0;
+
+    if (status > IPP_STATUS_OK_CONFLICTING)
+    {
+        setErrorString(QString::fromLocal8Bit(cupsLastErrorString()));
+        return false;
+    }
+
+    return true;
+}
+
+
+/************************************************
+
+ ************************************************/
+void CupsJobStream::cancel()
+{
+    if (!mJobId)
+        return;
+
+    close();
+    cupsFinishDocument(CUPS_HTTP_DEFAULT, mPrinterName.data());
+    cupsCancelJob2(CUPS_HTTP_DEFAULT, mPrinterName.data(), mJobId, 0);
+    mJobId = 0;
+}
+
+
+/************************************************
+
+ ************************************************/
+qint64 CupsJobStream::writeData(const char *data, qint64 len)
+{
+    if (cupsWriteRequestData(CUPS_HTTP_DEFAULT, data, len) != HTTP_STATUS_CONTINUE)
+    {
+        setErrorString(QString::fromLocal8Bit(cupsLastErrorString()));
+        return -1;
+    }
+
+    mWritten += len;
+
+    // The document is written in the GUI thread, the window
+    // is repainted while the scheduler receives the data.
+    if (mEventsTimer.elapsed() > PROCESS_EVENTS_TIME)
+    {
+        QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+        mEventsTimer.restart();
+    }
+
+    return len;
+}
+
 
 /************************************************
 
@@ -531,37 +716,76 @@ bool Printer::isSupportColor() const
 /************************************************
 
  ************************************************/
-bool Printer::print(const QList<Sheet *> &sheets, const QString &jobName, bool doubleSided, int numCopies, bool collate) const
+QString Printer::printFileName()
 {
-
-    QString file = QString("%1/.cache/boomaga_tmp_%2-print.pdf")
+    return QString("%1/.cache/boomaga_tmp_%2-print.pdf")
                           .arg(QDir::homePath())
                           .arg(QCoreApplication::applicationPid());
+}
 
-    project->writeDocument(sheets, file);
 
-    QStringList args;
-    args << "-P" << name();                       // Prints files to the named printer.
-    args << "-#" << QString("%1").arg(numCopies); // Sets the number of copies to print
-    args << "-T" << jobName;                      // Sets the job name.
-    args << "-r";                                 // The print files should be deleted after printing them
+//#define DEBUG_PRINT
+
+/************************************************
+
+ ************************************************/
+bool Printer::print(const QList<Sheet *> &sheets, const QString &jobName, bool doubleSided, int numCopies, bool collate) const
+{
+#ifndef DEBUG_PRINT
+    // Stream the document straight to the CUPS scheduler, so the printer
+    // gets the data while we are still writing it. If the scheduler doesn't
+    // accept the job, fall back to a temporary file and lpr.
+    CupsJobStream job;
+    if (job.start(name(), jobName, numCopies, printOptions(0, 0, doubleSided, collate)))
+    {
+        if (!project->writeDocument(sheets, &job))
+        {
+            job.cancel();
+            return false;
+        }
+
+        if (!job.finish())
+            return project->error(QObject::tr("I can't print to '%1'").arg(name()) + "\n" + job.errorString());
+
+        return true;
+    }
+#endif
+
+    QString file = printFileName();
+
+    if (!project->writeDocument(sheets, file))
+        return false;
+
+    return printFile(file, 0, 0, jobName, doubleSided, numCopies, collate, true);
+}
+
+
+/************************************************
+
+ ************************************************/
+QStringList Printer::printOptions(int firstPage, int lastPage, bool doubleSided, bool collate) const
+{
+    QStringList res;
+
+    if (firstPage > 0)
+        res << QString("page-ranges=%1-%2").arg(firstPage).arg(lastPage);
 
     // Duplex options ...........................
     if (duplexType() == DuplexAuto && doubleSided)
     {
         if (project->layout()->flipType(flipType()) == FlipType::LongEdge)
-            args << "-o sides=two-sided-long-edge";
+            res << "sides=two-sided-long-edge";
         else
-            args << "-o sides=two-sided-short-edge";
+            res << "sides=two-sided-short-edge";
     }
     else
     {
-        args << "-o sides=one-sided";               // Turn off duplex printing
+        res << "sides=one-sided";                   // Turn off duplex printing
     }
     // Duplex options ...........................
 
     if (collate)
-        args << "-o Collate=True";                      // Use the -o Collate=True option to get collated copies
+        res << "Collate=True";                      // Use the Collate=True option to get collated copies
 
 
     // Grayscale/color printing .................
@@ -572,45 +796,108 @@ bool Printer::print(const QList<Sheet *> &sheets, const QString &jobName, bool d
 
     case ColorModeColor:
         if (!mColorOption.isEmpty())
-            args << "-o " + mColorOption;
+            res << mColorOption;
         break;
 
     case ColorModeGrayscale:
         if (!mGrayscaleOption.isEmpty())
-            args << "-o " + mGrayscaleOption;
+            res << mGrayscaleOption;
         break;
 
     }
     // Grayscale/color printing .................
 
-    args << file.toLocal8Bit();
+    return res;
+}
 
-//#define DEBUG_PRINT
+
+/************************************************
+
+ ************************************************/
+QStringList Printer::lprArgs(const QString &fileName, int firstPage, int lastPage,
+                             const QString &jobName, bool doubleSided, int numCopies, bool collate,
+                             bool removeFile) const
+{
+    QStringList args;
+    args << "-P" << name();                       // Prints files to the named printer.
+    args << "-#" << QString("%1").arg(numCopies); // Sets the number of copies to print
+    args << "-T" << jobName;                      // Sets the job name.
+
+    if (removeFile)
+        args << "-r";                             // The print files should be deleted after printing them
+
+    foreach (const QString &opt, printOptions(firstPage, lastPage, doubleSided, collate))
+        args << "-o " + opt;
+
+    args << fileName.toLocal8Bit();
+    return args;
+}
+
+
+/************************************************
+
+ ************************************************/
+bool Printer::printFile(const QString &fileName, int firstPage, int lastPage,
+                        const QString &jobName, bool doubleSided, int numCopies, bool collate,
+                        bool removeFile) const
+{
 #ifndef DEBUG_PRINT
-    QProcess proc;
-    proc.startDetached("lpr", args);
-    return true;
+    if (removeFile)
+    {
+        QProcess::startDetached("lpr", lprArgs(fileName, firstPage, lastPage, jobName, doubleSided, numCopies, collate, true));
+        return true;
+    }
+
+    // The file is printed again by the next pass or removed by
+    // the caller, so lpr should finish reading it first.
+    QScopedPointer<QProcess> proc(startPrintFile(fileName, firstPage, lastPage, jobName, doubleSided, numCopies, collate));
+    proc->waitForFinished(-1);
+    return printFileFinished(proc.data());
 #else
     QString s = "lpr";
-    foreach (QString a, args)
+    foreach (QString a, lprArgs(fileName, firstPage, lastPage, jobName, doubleSided, numCopies, collate, removeFile))
     {
         s += " \"" + a + "\"";
     }
     qDebug(s.toLocal8Bit());
 
-    QString fileName;
-    {
-        QTemporaryFile f;
-        f.open();
-        fileName = f.fileName();
-        f.close();
-    }
-
-    project->writeDocument(sheets, fileName);
     QProcess::startDetached("okular", QStringList() << fileName);
     return true;
 #endif
 }
 
 
+/************************************************
+ * The caller owns the process and checks it with
+ * printFileFinished() after the finished() signal.
+ ************************************************/
+QProcess *Printer::startPrintFile(const QString &fileName, int firstPage, int lastPage,
+                                  const QString &jobName, bool doubleSided, int numCopies, bool collate) const
+{
+    QProcess *proc = new QProcess();
+#ifndef DEBUG_PRINT
+    proc->start("lpr", lprArgs(fileName, firstPage, lastPage, jobName, doubleSided, numCopies, collate, false));
+#else
+    printFile(fileName, firstPage, lastPage, jobName, doubleSided, numCopies, collate, false);
+    proc->start("true");
+#endif
+    return proc;
+}
+
+
+/************************************************
+ * Returns false and shows the error if lpr failed.
+ ************************************************/
+bool Printer::printFileFinished(QProcess *proc) const
+{
+    if (proc->state() != QProcess::NotRunning ||
+        proc->error() == QProcess::FailedToStart ||
+        proc->exitStatus() != QProcess::NormalExit ||
+        proc->exitCode() != 0)
+    {
+        return project->error(QObject::tr("I can't print to '%1'").arg(name()) + "\n" +
+                              QString::fromLocal8Bit(proc->readAllStandardError()));
+    }
 
+    return true;
+}
@@ -31,11 +31,13 @@
 #include <QObject>
 #include <QVector>
 #include <QString>
+#include <QStringList>
 #include <QPrinterInfo>
 #include <QExplicitlySharedDataPointer>
 #include <QIODevice>
 
 class Sheet;
+class QProcess;
 
 
 class PrinterProfile
@@ -162,6 +164,25 @@ public:
 
     virtual bool print(const QList<Sheet*> &sheets, const QString &jobName, bool doubleSided, int numCopies, bool collate) const;
 
+    // Prints pages firstPage..lastPage (1-based) of an already written document.
+    // If firstPage is 0, the whole document is printed. The split duplex passes
+    // use it to print both passes from one document. If removeFile is false,
+    // it returns when the file is sent, so the caller can remove it.
+    virtual bool printFile(const QString &fileName, int firstPage, int lastPage,
+                           const QString &jobName, bool doubleSided, int numCopies, bool collate,
+                           bool removeFile) const;
+
+    // The same as printFile() without removeFile, but doesn't wait: the file
+    // is sent when the process is finished, see printFileFinished().
+    QProcess *startPrintFile(const QString &fileName, int firstPage, int lastPage,
+                             const QString &jobName, bool doubleSided, int numCopies, bool collate) const;
+    bool printFileFinished(QProcess *proc) const;
+
+    static QString printFileName();
+
+    // CUPS options ("name=value") for the current profile.
+    QStringList printOptions(int firstPage, int lastPage, bool doubleSided, bool collate) const;
+
     QString deviceUri() const { return mDeviceUri; }
 
     void readSettings();
@@ -183,6 +204,10 @@ private:
     PrinterProfile mDefaultCupsProfile;
     QString mGrayscaleOption;
     QString mColorOption;
+
+    QStringList lprArgs(const QString &fileName, int firstPage, int lastPage,
+                        const QString &jobName, bool doubleSided, int numCopies, bool collate,
+                        bool removeFile) const;
 };
 
 #endif // PRINTER_H
@@ -33,6 +33,7 @@
 #include "layout.h"
 #include "iofiles/infile.h"
 #include "iofiles/boofile.h"
+#include "pdfparser/pdfreader.h"
 
 #include <unistd.h>
 #include <fstream>
@@ -43,12 +44,16 @@
 #include <QDebug>
 #include <QFile>
 #include <QMessageBox>
+#include <QApplication>
 #include <QDateTime>
 #include <QUuid>
 #include <QUrl>
 
 #define META_SIZE (4 * 1024)
 
+// In ms
+#define IMPORT_REFRESH_TIME 500
+
 using namespace  std;
 
 class ProjectState
@@ -57,23 +62,52 @@ public:
     explicit ProjectState(const Project *p):
         mProject(p),
         mCurrentPage(p->currentPage()),
-        mCurrentSheet(p->currentSheet())
+        mCurrentSheet(p->currentSheet()),
+        mCurrentPageNum(p->currentPageNum()),
+        mCurrentSheetNum(p->currentSheetNum())
     {
     }
 
     const ProjectPage *currentPage() const { return mCurrentPage; }
     const Sheet *currentSheet() const { return mCurrentSheet; }
 
-    bool currentPageChanged() const { return mCurrentPage != mProject->currentPage(); }
-    bool currentSheetChanged() const { return mCurrentSheet != mProject->currentSheet(); }
+    // The kept sheets and pages can be renumbered by the update.
+    bool currentPageChanged() const
+    {
+        return mCurrentPage != mProject->currentPage() ||
+               mCurrentPageNum != mProject->currentPageNum();
+    }
+
+    bool currentSheetChanged() const
+    {
+        return mCurrentSheet != mProject->currentSheet() ||
+               mCurrentSheetNum != mProject->currentSheetNum();
+    }
 
 private:
     const Project *mProject;
     const ProjectPage *mCurrentPage;
     const Sheet *mCurrentSheet;
+    int mCurrentPageNum;
+    int mCurrentSheetNum;
 };
 
 
+/************************************************
+ * The number of the project pages on the sheet.
+ ************************************************/
+static int sheetPageCount(const Sheet *sheet)
+{
+    int res = 0;
+    for (int i=0; i<sheet->count(); ++i)
+    {
+        if (sheet->page(i))
+            ++res;
+    }
+    return res;
+}
+
+
 /************************************************
 
  ************************************************/
@@ -90,6 +124,10 @@ Project::Project(QObject *parent) :
     mDoubleSided(true),
     mRotation(NoRotate)
 {
+    mImportTimer.setSingleShot(true);
+    mImportTimer.setInterval(IMPORT_REFRESH_TIME);
+    connect(&mImportTimer, SIGNAL(timeout()),
+            this, SLOT(refreshImportedPages()));
 }
 
 
@@ -111,6 +149,7 @@ void Project::free()
     {
         if (job.fileName().endsWith(AUTOREMOVE_EXT))
         {
+            PDF::Reader::releaseShared(job.fileName());
             QFile(job.fileName()).remove();
         }
     }
@@ -133,6 +172,15 @@ TmpPdfFile *Project::createTmpPdfFile()
     connect(res, SIGNAL(merged()),
             this, SLOT(tmpFileMerged()));
 
+    connect(res, SIGNAL(error(QString)),
+            this, SLOT(tmpFileError(QString)));
+
+    connect(res, SIGNAL(pagesImported(QList<ProjectPage*>)),
+            this, SLOT(tmpFilePagesImported(QList<ProjectPage*>)));
+
+    connect(this, SIGNAL(currentSheetChanged(Sheet*)),
+            res, SLOT(importFirst(Sheet*)));
+
     return res;
 }
 
@@ -159,7 +207,7 @@ void Project::addJobs(const JobList &jobs)
         }
 
         stopMerging();
-        update();
+        updateSheets();
 
         mLastTmpFile = createTmpPdfFile();
         mLastTmpFile->merge(mJobs);
@@ -184,7 +232,7 @@ void Project::removeJob(int index)
 
         QString fileName = mJobs.at(index).fileName();
         mJobs.removeAt(index);
-        update();
+        updateSheets();
 
         if (fileName.endsWith(AUTOREMOVE_EXT))
         {
@@ -193,7 +241,10 @@ void Project::removeJob(int index)
                 remove = remove && job.fileName() != fileName;
 
             if (remove)
+            {
+                PDF::Reader::releaseShared(fileName);
                 QFile(fileName).remove();
+            }
         }
 
         mLastTmpFile = createTmpPdfFile();
@@ -213,7 +264,7 @@ void Project::removeJob(int index)
 void Project::moveJob(int from, int to)
 {
     mJobs.move(from, to);
-    update();
+    updateSheets();
 }
 
 
@@ -245,6 +296,8 @@ void Project::tmpFileMerged()
     delete mTmpFile;
     mTmpFile = mLastTmpFile;
     mLastTmpFile = 0;
+    mImportedPages.clear();
+    mImportTimer.stop();
 
     if (mMetaData.title().isEmpty() && !mJobs.isEmpty())
     {
@@ -252,20 +305,48 @@ void Project::tmpFileMerged()
     }
 
     update();
+    mTmpFile->importFirst(currentSheet());
 }
 
 
 /************************************************
-
+ * The printer, the layout or the settings were changed,
+ * all the sheets are recomputed.
  ************************************************/
 void Project::update()
+{
+    doUpdate(true);
+}
+
+
+/************************************************
+ * The pages were hidden, inserted, moved or rotated.
+ * Only the sheets which differ from the current ones
+ * are replaced, see sheetsReplaced().
+ ************************************************/
+void Project::updateSheets()
+{
+    doUpdate(false);
+}
+
+
+/************************************************
+ * The new sheets are compared with the current ones from
+ * the both ends. The equal sheets at the start are kept,
+ * the equal sheets at the end are kept and renumbered, so
+ * the views have to update only the sheets in the middle.
+ ************************************************/
+void Project::doUpdate(bool full)
 {
     ProjectState state(this);
     ProjectPage *curPage = 0;
+    const int oldPageCount = mPages.count();
 
     mPages.clear();
-    foreach(const Job &job, mJobs)
+    mPageJobs.clear();
+    for (int j=0; j<mJobs.count(); ++j)
     {
+        const Job &job = mJobs.at(j);
         for (int p=0; p<job.pageCount(); ++p)
         {
             ProjectPage *page = job.page(p);
@@ -273,6 +354,7 @@ void Project::update()
             {
                 page->setPageNum(mPages.count());
                 mPages << page;
+                mPageJobs << j;
                 if (page == mCurrentPage)
                     curPage = page;
             }
@@ -292,31 +374,75 @@ void Project::update()
 
     mSheetCount = 0;
 
-    qDeleteAll(mPreviewSheets);
-    mPreviewSheets.clear();
-    bool emitTmpFileRenamed = false;
-
+    SheetList sheets;
     if (!mPages.isEmpty())
     {
         mLayout->updatePages(mPages);
         mSheetCount = mLayout->calcSheetCount();
 
         Direction direction = settings->value(Settings::RightToLeft).toBool() ? RightToLeft : LeftToRight;
-        mLayout->fillPreviewSheets(&mPreviewSheets, direction);
+        mLayout->fillPreviewSheets(&sheets, direction);
+    }
 
-        if (mTmpFile)
-        {
-            mTmpFile->updateSheets(mPreviewSheets);
-            emitTmpFileRenamed = true;
-        }
+    // The unchanged sheets at the start and at the end.
+    int head = 0;
+    int tail = 0;
+    if (!full)
+    {
+        int count = qMin(sheets.count(), mPreviewSheets.count());
+        while (head < count && mPreviewSheets.at(head)->isSame(*sheets.at(head)))
+            ++head;
+
+        while (tail < count - head &&
+               mPreviewSheets.at(mPreviewSheets.count() - 1 - tail)->isSame(*sheets.at(sheets.count() - 1 - tail)))
+            ++tail;
     }
 
-    foreach (Sheet *s, mPreviewSheets)
+    const int oldSheetCount = mPreviewSheets.count();
+    for (int i=0; i<sheets.count(); ++i)
     {
-        for (int i=0; i<s->count(); ++i)
+        int old = -1;
+        if (i < head)
+            old = i;
+        else if (i >= sheets.count() - tail)
+            old = i - sheets.count() + oldSheetCount;
+
+        if (old < 0)
+            continue;
+
+        delete sheets.at(i);
+        sheets[i] = mPreviewSheets.at(old);
+        sheets[i]->setSheetNum(i);
+        mPreviewSheets[old] = 0;
+    }
+
+    qDeleteAll(mPreviewSheets);
+    mPreviewSheets = sheets;
+
+    // The pages go through the sheets in their order,
+    // so the kept sheets hold the unchanged pages.
+    int headPages = 0;
+    for (int i=0; i<head; ++i)
+        headPages += sheetPageCount(mPreviewSheets.at(i));
+
+    int tailPages = 0;
+    for (int i=mPreviewSheets.count() - tail; i<mPreviewSheets.count(); ++i)
+        tailPages += sheetPageCount(mPreviewSheets.at(i));
+
+    bool emitTmpFileRenamed = false;
+    if (mTmpFile && !mPreviewSheets.isEmpty())
+    {
+        mTmpFile->updateSheets(mPreviewSheets, head, mPreviewSheets.count() - head - tail);
+        emitTmpFileRenamed = true;
+    }
+
+    for (int i=head; i<mPreviewSheets.count() - tail; ++i)
+    {
+        Sheet *s = mPreviewSheets.at(i);
+        for (int p=0; p<s->count(); ++p)
         {
-            if (s->page(i))
-                s->page(i)->setSheet(s);
+            if (s->page(p))
+                s->page(p)->setSheet(s);
 
         }
     }
@@ -332,6 +458,20 @@ void Project::update()
     if (emitTmpFileRenamed)
         emit tmpFileRenamed(mTmpFile->fileName());
 
+    if (full || head + tail < qMax(oldSheetCount, mPreviewSheets.count()))
+    {
+        emit sheetsReplaced(head,
+                            oldSheetCount - head - tail,
+                            mPreviewSheets.count() - head - tail);
+    }
+
+    if (full || headPages + tailPages < qMax(oldPageCount, mPages.count()))
+    {
+        emit pagesReplaced(headPages,
+                           oldPageCount - headPages - tailPages,
+                           mPages.count() - headPages - tailPages);
+    }
+
     if (state.currentSheetChanged())
     {
         emit currentSheetChanged(currentSheet());
@@ -348,6 +488,24 @@ void Project::update()
 }
 
 
+/************************************************
+ * The jobs of the visible pages are remembered by
+ * the update, so the job is found without a search.
+ ************************************************/
+const Job *Project::jobOfPage(const ProjectPage *page) const
+{
+    int n = page->pageNum();
+    if (n < 0 || n >= mPages.count() || mPages.at(n) != page)
+        return 0;
+
+    int j = mPageJobs.at(n);
+    if (j >= mJobs.count())
+        return 0;
+
+    return &mJobs.at(j);
+}
+
+
 /************************************************
  *
  ************************************************/
@@ -425,7 +583,7 @@ void Project::deletePage(ProjectPage *page)
 
 
     mCurrentPage = nextCurPage;
-    update();
+    updateSheets();
 }
 
 
@@ -439,7 +597,7 @@ void Project::undoDeletePage(ProjectPage *page)
 
     page->show();
     mCurrentPage = page;
-    update();
+    updateSheets();
 }
 
 
@@ -473,7 +631,7 @@ void Project::deletePagesEnd(ProjectPage *page)
 
     job.removePages(deleted);
     mCurrentPage = nextCurPage;
-    update();
+    updateSheets();
 }
 
 
@@ -488,7 +646,7 @@ void Project::insertBlankPageBefore(ProjectPage *page)
 
     Job job = jobs()->value(j);
     mCurrentPage = job.insertBlankPage(job.indexOfPage(page));
-    this->update();
+    this->updateSheets();
 }
 
 
@@ -503,7 +661,7 @@ void Project::insertBlankPageAfter(ProjectPage *page)
 
     Job job = jobs()->value(j);
     mCurrentPage = job.insertBlankPage(job.indexOfPage(page) + 1);
-    this->update();
+    this->updateSheets();
 }
 
 
@@ -702,6 +860,26 @@ Rotation Project::calcRotation(const QList<ProjectPage *> &pages, const Layout *
 }
 
 
+/************************************************
+ * Waits until the pages imported in the
+ * background are in the temp file.
+ ************************************************/
+void Project::finishImport()
+{
+    if (!mTmpFile)
+        return;
+
+    if (mTmpFile->isImporting())
+    {
+        ProjectLongTask task(tr("Importing the pages..."));
+        emit longTaskStarted(&task);
+        mTmpFile->finishImport();
+    }
+
+    refreshImportedPages();
+}
+
+
 /************************************************
 
  ************************************************/
@@ -709,12 +887,114 @@ void Project::stopMerging()
 {
     if (mLastTmpFile)
     {
+        mLastTmpFile->cancelMerge();
         mLastTmpFile->deleteLater();
         mLastTmpFile = 0;
     }
 }
 
 
+/************************************************
+
+ ************************************************/
+void Project::tmpFileError(const QString &message)
+{
+    if (sender() == mLastTmpFile)
+        stopMerging();
+    else if (sender() != mTmpFile)
+        return;
+
+    error(message);
+}
+
+
+/************************************************
+ * The background import added pages to the current file.
+ * The views are refreshed by refreshImportedPages(), the
+ * chunks imported meanwhile are collected.
+ ************************************************/
+void Project::tmpFilePagesImported(const QList<ProjectPage *> &pages)
+{
+    if (sender() != mTmpFile)
+        return;
+
+    foreach (ProjectPage *page, pages)
+        mImportedPages << page;
+
+    if (!mImportTimer.isActive())
+        mImportTimer.start();
+}
+
+
+/************************************************
+ * The views hold blank images for the imported pages,
+ * the sheets and the pages are replaced by themselves
+ * to drop the images. The composed images are kept.
+ ************************************************/
+void Project::refreshImportedPages()
+{
+    mImportTimer.stop();
+    if (!mTmpFile || mImportedPages.isEmpty())
+        return;
+
+    QList<QPointer<ProjectPage> > pages = mImportedPages;
+    mImportedPages.clear();
+
+    // The sheets are the same, only the tail is written again.
+    if (!mPreviewSheets.isEmpty())
+        mTmpFile->updateSheets(mPreviewSheets, 0, 0);
+
+    emit tmpFileUpdated(mTmpFile->fileName());
+
+    QVector<bool> sheets(mPreviewSheets.count(), false);
+    QVector<bool> pageNums(mPages.count(), false);
+    bool found = false;
+    foreach (const ProjectPage *page, pages)
+    {
+        if (!page)
+            continue;
+
+        int n = page->pageNum();
+        if (n < 0 || n >= mPages.count() || mPages.at(n) != page)
+            continue;
+
+        pageNums[n] = true;
+        found = true;
+
+        const Sheet *sheet = page->sheet();
+        if (sheet && sheet->sheetNum() >= 0 && sheet->sheetNum() < sheets.count())
+            sheets[sheet->sheetNum()] = true;
+    }
+
+    if (!found)
+        return;
+
+    for (int i=0; i<sheets.count(); ++i)
+    {
+        int count = 0;
+        while (i + count < sheets.count() && sheets.at(i + count))
+            ++count;
+
+        if (count)
+            emit sheetsReplaced(i, count, count);
+        i += count;
+    }
+
+    for (int i=0; i<pageNums.count(); ++i)
+    {
+        int count = 0;
+        while (i + count < pageNums.count() && pageNums.at(i + count))
+            ++count;
+
+        if (count)
+            emit pagesReplaced(i, count, count);
+        i += count;
+    }
+
+    emit changed();
+}
+
+
 /************************************************
 
  ************************************************/
@@ -730,8 +1010,12 @@ void Project::tmpFileProgress(int progr, int all) const
  ************************************************/
 bool Project::error(const QString &message) const
 {
-    QMessageBox::critical(0, tr("Boomaga", "Error message title"), message);
+    // There are no widgets in the batch mode.
+    if (qobject_cast<QApplication*>(QCoreApplication::instance()))
+        QMessageBox::critical(0, tr("Boomaga", "Error message title"), message);
+
     qWarning() << message;
+    emit errorOccurred(message);
     return false;
 }
 
@@ -785,10 +1069,12 @@ QList<Sheet*> Project::selectSheets(Project::PagesType pages, Project::PagesOrde
 
 
 /************************************************
-
+ * The pages imported in the background are waited
+ * for with the progress shown.
  ************************************************/
 bool Project::writeDocument(const QList<Sheet*> &sheets, QIODevice *out)
 {
+    finishImport();
     return mTmpFile->writeDocument(sheets, out);
 }
 
@@ -36,6 +36,8 @@
 #include <QStringList>
 #include <QImage>
 #include <QPointer>
+#include <QVector>
+#include <QTimer>
 
 class Job;
 class TmpPdfFile;
@@ -122,6 +124,9 @@ public:
     ProjectPage *page(int index) const { return mPages.at(index); }
     QList<ProjectPage*> pages() const { return mPages; }
 
+    // The job of the visible page, 0 for the hidden one.
+    const Job *jobOfPage(const ProjectPage *page) const;
+
     int sheetCount() const { return mSheetCount; }
     QList<Sheet*> selectSheets(PagesType pages = AllPages, PagesOrder order = ForwardOrder) const;
 
@@ -144,6 +149,7 @@ public:
     void free();
 
     void save(const QString &fileName);
+    void finishImport();
 
     Rotation rotation() const { return mRotation; }
 
@@ -194,24 +200,41 @@ public slots:
     void setLayout(const Layout *layout);
     void setDoubleSided(bool value);
     void update();
+    void updateSheets();
 
 
 signals:
     void changed();
+
+    // The sheets from first to first + oldCount were replaced by newCount
+    // sheets, the sheets after them were renumbered. The images of the
+    // other sheets are still valid.
+    void sheetsReplaced(int first, int oldCount, int newCount);
+
+    // The same for the pages, the pages of the replaced sheets are replaced.
+    void pagesReplaced(int first, int oldCount, int newCount);
+
     void progress(int progr, int all) const;
     void tmpFileRenamed(const QString &mTmpFileName);
+
+    // The imported pages were appended to the same temp file.
+    void tmpFileUpdated(const QString &mTmpFileName);
     void currentPageChanged(ProjectPage *page);
     void currentPageChanged(int page);
     void currentSheetChanged(Sheet *sheet);
     void currentSheetChanged(int sheet);
     void longTaskStarted(const ProjectLongTask *task);
+    void errorOccurred(const QString &message) const;
 
 protected:
     Rotation calcRotation(const QList<ProjectPage *> &pages, const Layout *layout) const;
 
 private slots:
     void tmpFileMerged();
+    void tmpFileError(const QString &message);
+    void tmpFilePagesImported(const QList<ProjectPage*> &pages);
     void tmpFileProgress(int progr, int all) const;
+    void refreshImportedPages();
 
 private:
     explicit Project(QObject *parent = 0);
@@ -219,6 +242,7 @@ private:
 
     const Layout *mLayout;
     QList<ProjectPage*> mPages;
+    QVector<int> mPageJobs;     // The job index of the page in mPages
     QPointer<ProjectPage> mCurrentPage;
     Sheet *mCurrentSheet;
     JobList mJobs;
@@ -228,6 +252,11 @@ private:
     TmpPdfFile *mTmpFile;
     TmpPdfFile *mLastTmpFile;
 
+    // The pages imported since the last refresh, the views
+    // are updated at most once per IMPORT_REFRESH_TIME.
+    QList<QPointer<ProjectPage> > mImportedPages;
+    QTimer mImportTimer;
+
     Printer mNullPrinter;
     Printer *mPrinter;
     bool mDoubleSided;
@@ -237,6 +266,7 @@ private:
 
     TmpPdfFile *createTmpPdfFile();
     void stopMerging();
+    void doUpdate(bool full);
 };
 
 
@@ -40,8 +40,12 @@ Sheet::Sheet(int count, int sheetNum):
     mRotation(project->rotation())
 {
     mPages.resize(count);
+    mPageRotations.resize(count);
     for (int i=0; i<count; ++i)
+    {
         mPages[i] = 0;
+        mPageRotations[i] = NoRotate;
+    }
 }
 
 
@@ -59,6 +63,7 @@ Sheet::~Sheet()
 void Sheet::setPage(int index, ProjectPage *page)
 {
     mPages[index] = page;
+    mPageRotations[index] = page ? page->manualRotation() : NoRotate;
 }
 
 
@@ -110,6 +115,19 @@ ProjectPage *Sheet::lastVisiblePage() const
 }
 
 
+/************************************************
+ * The page can be rotated after the sheet was filled,
+ * so the rotations saved by setPage() are compared.
+ ************************************************/
+bool Sheet::isSame(const Sheet &other) const
+{
+    return mPages == other.mPages &&
+           mPageRotations == other.mPageRotations &&
+           mHints == other.mHints &&
+           mRotation == other.mRotation;
+}
+
+
 /************************************************
 
  ************************************************/
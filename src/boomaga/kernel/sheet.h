@@ -38,6 +38,7 @@ class ProjectPage;
 
 class Sheet
 {
+    friend class Project;
 public:
     enum Hint{
         HintOnlyLeft    = 1,
@@ -69,8 +70,16 @@ public:
     ProjectPage *firstVisiblePage() const;
     ProjectPage *lastVisiblePage() const;
 
+    // The sheets have the same pages with the same rotation,
+    // the hints and the sheet rotation are equal as well.
+    bool isSame(const Sheet &other) const;
+
+protected:
+    void setSheetNum(int value) { mSheetNum = value; }
+
 private:
     QVector<ProjectPage*> mPages;
+    QVector<Rotation> mPageRotations;   // As they were when the pages were set
     int mSheetNum;
     Hints mHints;
     Rotation mRotation;
@@ -24,10 +24,16 @@
  * END_COMMON_COPYRIGHT_HEADER */
 
 #include "tmppdffile.h"
+#include <QCoreApplication>
 #include <QCryptographicHash>
 #include <QDir>
-#include <cmath>
 #include <QDateTime>
+#include <QTransform>
+#include <QBuffer>
+#include <QElapsedTimer>
+#include <QScopedPointer>
+#include <QSet>
+#include <algorithm>
 
 #include "sheet.h"
 #include "layout.h"
@@ -38,6 +44,31 @@
 #include "printer.h"
 #include "project.h"
 
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+// The sheets tail is rewritten from scratch after this many incremental sections
+#define MAX_TAIL_SECTIONS   64
+// ... or when the appended sections outgrow the compacted tail
+#define MAX_TAIL_GROWTH     4
+#define MIN_TAIL_SIZE       qint64(4 * 1024 * 1024)
+
+// Jobs with more pages are imported in the background, see PdfMerger
+#define LAZY_IMPORT_PAGES   200
+// How often the imported pages are passed to the file, in ms
+#define CHUNK_TIME          1000
+#define CHUNK_TIME_URGENT   300
+
+// The decimal places of the numbers written to the sheet streams
+#define NUM_DECIMALS        3
+#define MATRIX_DECIMALS     6
+
 
 /************************************************
 
@@ -64,11 +95,15 @@ QIODevice &operator<<(QIODevice &out, const int value)
  ************************************************/
 TmpPdfFile::TmpPdfFile(QObject *parent):
     QObject(parent),
-    mValid(false)
+    mValid(false),
+    mMerger(0)
 {
     mOrigFileSize = 0;
     mOrigXrefPos = 0;
     mFirstFreeNum = 0;
+    mLastXrefPos = 0;
+    mTailSections = 0;
+    mCompactTailSize = 0;
 
     mFileName = genTmpFileName(".tmp");
 }
@@ -79,100 +114,513 @@ TmpPdfFile::TmpPdfFile(QObject *parent):
  ************************************************/
 TmpPdfFile::~TmpPdfFile()
 {
+    stopMerger();
     QFile::remove(mFileName);
 }
 
 
 /************************************************
-
+ * Starts merging in the background, the merged() signal
+ * is emitted when the file is ready.
  ************************************************/
 void TmpPdfFile::merge(const JobList &jobs)
 {
-    QFile file(mFileName);
-    if (! file.open(QFile::WriteOnly | QFile::Truncate))
+    stopMerger();
+    mValid = false;
+    mJobs = jobs;
+    mJobPageStart.clear();
+
+    QVector<PdfMerger::Source> sources;
+    sources.reserve(jobs.count());
+    foreach (const Job &job, jobs)
     {
-        throw BoomagaError(tr("I can't write file \"%1\"")
-                           .arg(file.fileName())
-                           + "\n" + file.errorString());
+        PdfMerger::Source src = { job.fileName(), job.fileStartPos(), job.fileEndPos() };
+        sources << src;
     }
 
-    try
+    mMerger = new PdfMerger(mFileName, sources);
+
+    connect(mMerger, SIGNAL(progress(int,int)),
+            this, SLOT(mergerProgress(int,int)));
+
+    connect(mMerger, SIGNAL(pagesReady()),
+            this, SLOT(mergerPagesReady()));
+
+    connect(mMerger, SIGNAL(chunksReady()),
+            this, SLOT(mergerChunksReady()));
+
+    connect(mMerger, SIGNAL(finished()),
+            this, SLOT(mergerFinished()));
+
+    connect(mMerger, SIGNAL(failed(QString)),
+            this, SLOT(mergerFailed(QString)));
+
+    mMerger->moveToThread(mMerger->workerThread());
+    mMerger->workerThread()->start();
+
+    QMetaObject::invokeMethod(mMerger, "run", Qt::QueuedConnection);
+}
+
+
+/************************************************
+ * Asks the merger to stop, doesn't wait for it.
+ ************************************************/
+void TmpPdfFile::cancelMerge()
+{
+    if (mMerger)
+        mMerger->cancel();
+}
+
+
+/************************************************
+ * Cancels the merging without waiting for the thread.
+ * The merger checks the flag after each page, it is
+ * deleted in the GUI thread when its thread is finished.
+ ************************************************/
+void TmpPdfFile::stopMerger()
+{
+    if (!mMerger)
+        return;
+
+    PdfMerger *merger = mMerger;
+    mMerger = 0;
+
+    // The already queued signals are filtered by sender().
+    disconnect(merger, 0, this, 0);
+    merger->cancel();
+
+    // The thread is a member of the merger.
+    connect(merger->workerThread(), &QThread::finished, qApp, [merger]()
     {
-        PDF::Writer writer(&file);
-        writer.writePDFHeader(1,7);
+        merger->workerThread()->wait();
+        delete merger;
+    }, Qt::QueuedConnection);
+
+    merger->workerThread()->quit();
+}
 
-        QVector<PdfProcessor*> procs;
-        procs.reserve(jobs.count());
 
-        quint32 pagesCnt = 0;
-        foreach (const Job &job, jobs)
+/************************************************
+
+ ************************************************/
+void TmpPdfFile::finishImport()
+{
+    while (mMerger && mValid)
+    {
+        bool done = mMerger->waitForChunks();
+        QList<PdfMerger::Chunk> chunks = mMerger->takeChunks();
+        if (appendChunks(chunks))
+            emit pagesImported(chunksPages(chunks));
+
+        if (done)
         {
-            auto proc = new PdfProcessor(job.fileName(), job.fileStartPos(), job.fileEndPos());
-            proc->open();
-            pagesCnt += proc->pageCount();
-            procs << proc;
+            QString err = mMerger->errorString();
+            stopMerger();
+
+            if (!err.isEmpty())
+                emit error(err);
+
+            break;
         }
 
+        // Keeps the progress shown, the queued signals of
+        // the merger find the chunks already taken.
+        QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+    }
+}
 
-        QVector<PdfPageInfo> pages;
 
-        int ready =0;
-        for (int i=0; i<jobs.count(); ++i)
+/************************************************
+ * The sheet pages will be imported before the others.
+ ************************************************/
+void TmpPdfFile::importFirst(Sheet *sheet)
+{
+    if (!mMerger || !sheet || mJobPageStart.isEmpty())
+        return;
+
+    int first = -1;
+    for (int i=0; i<sheet->count(); ++i)
+    {
+        const ProjectPage *page = sheet->page(i);
+        if (!page || page->jobPageNum() < 0)
+            continue;
+
+        for (int j=0; j<mJobs.count() && j<mJobPageStart.count(); ++j)
         {
-            const Job &job = jobs.at(i);
-            PdfProcessor *proc = procs.at(i);
+            if (mJobs.at(j).indexOfPage(page) < 0)
+                continue;
 
-            QDateTime prevEmit;
-            connect(proc, &PdfProcessor::pageReady, [this, &ready, pagesCnt, &prevEmit] ()
-            {
-                ++ready;
+            int n = mJobPageStart.at(j) + page->jobPageNum();
+            if (first < 0 || n < first)
+                first = n;
+            break;
+        }
+    }
 
-                QDateTime now = QDateTime::currentDateTime();
-                if (now.toMSecsSinceEpoch() - prevEmit.toMSecsSinceEpoch() > 100)
-                {
-                    prevEmit = now;
-                    emit progress(ready, pagesCnt);
-                    qApp->processEvents();
-                }
-            });
+    if (first > -1)
+        mMerger->setPriorityPage(first);
+}
 
-            proc->run(&writer, writer.xRefTable().maxObjNum() + 3);
 
-            for (int p=0; p<job.pageCount(); ++p)
-            {
-                ProjectPage *page = job.page(p);
-                if (page->jobPageNum() < 0)
-                    continue;
+/************************************************
 
-                if (page->jobPageNum() >= proc->pageInfo().count())
-                    continue;
+ ************************************************/
+void TmpPdfFile::mergerProgress(int progress, int all)
+{
+    // The signal could be queued before the merger was canceled.
+    if (!mMerger || sender() != mMerger)
+        return;
 
-                page->setPdfInfo(proc->pageInfo().at(page->jobPageNum()));
+    emit this->progress(progress, all);
+}
 
-            }
 
-            pages << proc->pageInfo();
-        }
-        qDeleteAll(procs);
+/************************************************
 
-        writeCatalog(&writer, pages);
-        file.close();
-        mValid = true;
+ ************************************************/
+void TmpPdfFile::mergerPagesReady()
+{
+    // The signal could be queued before the merger was canceled.
+    if (!mMerger || sender() != mMerger)
+        return;
 
-    }
-    catch (PDF::Error &err)
+    setMergedPart(mMerger->origFileSize(), mMerger->origXrefPos(), mMerger->firstFreeNum());
+
+    const QVector<QVector<PdfPageInfo> > &pageInfo = mMerger->pageInfo();
+    int start = 0;
+    for (int i=0; i<mJobs.count() && i<pageInfo.count(); ++i)
     {
-        throw BoomagaError(err.what());
+        const Job &job = mJobs.at(i);
+        const QVector<PdfPageInfo> &info = pageInfo.at(i);
+
+        mJobPageStart << start;
+        start += info.count();
+
+        for (int p=0; p<job.pageCount(); ++p)
+        {
+            ProjectPage *page = job.page(p);
+            if (page->jobPageNum() < 0)
+                continue;
+
+            if (page->jobPageNum() >= info.count())
+                continue;
+
+            page->setPdfInfo(info.at(page->jobPageNum()));
+        }
     }
+
+    // Small jobs are imported completely before pagesReady.
+    appendChunks(mMerger->takeChunks());
+    mValid = true;
+
     emit progress(-1, -1);
     emit merged();
 }
 
 
+/************************************************
+
+ ************************************************/
+void TmpPdfFile::mergerChunksReady()
+{
+    if (!mMerger || sender() != mMerger || !mValid)
+        return;
+
+    QList<PdfMerger::Chunk> chunks = mMerger->takeChunks();
+    if (appendChunks(chunks))
+        emit pagesImported(chunksPages(chunks));
+}
+
+
+/************************************************
+
+ ************************************************/
+void TmpPdfFile::mergerFinished()
+{
+    if (!mMerger || sender() != mMerger || !mValid)
+        return;
+
+    QList<PdfMerger::Chunk> chunks = mMerger->takeChunks();
+    bool imported = appendChunks(chunks);
+    stopMerger();
+
+    if (imported)
+        emit pagesImported(chunksPages(chunks));
+}
+
+
+/************************************************
+
+ ************************************************/
+void TmpPdfFile::mergerFailed(const QString &message)
+{
+    if (!mMerger || sender() != mMerger)
+        return;
+
+    stopMerger();
+    emit progress(-1, -1);
+    emit error(message);
+}
+
+
 /************************************************
  *
  ************************************************/
-void TmpPdfFile::writeCatalog(PDF::Writer *writer, const QVector<PdfPageInfo> &pages)
+PdfMerger::PdfMerger(const QString &fileName, const QVector<Source> &sources):
+    QObject(),
+    mFileName(fileName),
+    mSources(sources),
+    mCanceled(0),
+    mPriorityPage(0),
+    mFirstFreeNum(0),
+    mOrigFileSize(0),
+    mOrigXrefPos(0),
+    mDone(false)
+{
+}
+
+
+/************************************************
+ *
+ ************************************************/
+PdfMerger::~PdfMerger()
+{
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PdfMerger::run()
+{
+    QString err;
+    try
+    {
+        merge();
+    }
+    catch (PDF::Error &e)
+    {
+        err = e.what();
+    }
+    catch (BoomagaError &e)
+    {
+        err = e.what();
+    }
+    catch (const QString &e)
+    {
+        err = e;
+    }
+
+    {
+        QMutexLocker locker(&mMutex);
+        mErrorString = err;
+        mDone = true;
+        mChunksCond.wakeAll();
+    }
+
+    if (!err.isEmpty())
+        emit failed(err);
+    else if (!isCanceled())
+        emit finished();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+QList<PdfMerger::Chunk> PdfMerger::takeChunks()
+{
+    QMutexLocker locker(&mMutex);
+    QList<Chunk> res = mChunks;
+    mChunks.clear();
+    return res;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+bool PdfMerger::waitForChunks()
+{
+    QMutexLocker locker(&mMutex);
+    while (mChunks.isEmpty() && !mDone)
+        mChunksCond.wait(&mMutex);
+
+    return mDone;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+QString PdfMerger::errorString() const
+{
+    QMutexLocker locker(&mMutex);
+    return mErrorString;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PdfMerger::addChunk(const Chunk &chunk)
+{
+    {
+        QMutexLocker locker(&mMutex);
+        mChunks << chunk;
+        mChunksCond.wakeAll();
+    }
+    emit chunksReady();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PdfMerger::merge()
+{
+    QFile file(mFileName);
+    if (! file.open(QFile::WriteOnly | QFile::Truncate))
+    {
+        throw BoomagaError(TmpPdfFile::tr("I can't write file \"%1\"")
+                           .arg(file.fileName())
+                           + "\n" + file.errorString());
+    }
+
+    QVector<PdfProcessor*> procs;
+    procs.reserve(mSources.count());
+
+    // Page trees ...............................
+    // Objects 1 and 2 are the catalog and pages, each job gets
+    // its own range of the object numbers.
+    QVector<PdfPageInfo> pages;
+    QVector<int> jobPageStart;
+    quint32 objNumOffset = 3;
+    foreach (const Source &src, mSources)
+    {
+        auto proc = new PdfProcessor(src.fileName, src.startPos, src.endPos);
+        proc->setCancelFlag(&mCanceled);
+        procs << proc;
+        proc->open();
+        proc->readPages(objNumOffset);
+        objNumOffset += proc->maxObjNum() + 3;
+
+        jobPageStart << pages.count();
+        mPageInfo << proc->pageInfo();
+        pages << proc->pageInfo();
+    }
+    // ..........................................
+
+    PDF::Writer writer(&file);
+    writer.writePDFHeader(1,7);
+
+    // Empty placeholders for the pages .........
+    foreach (const PdfPageInfo &info, pages)
+    {
+        foreach (PDF::ObjNum num, info.xObjNums)
+        {
+            PDF::Object xObj(num);
+            xObj.dict().insert("Type",     PDF::Name("XObject"));
+            xObj.dict().insert("Subtype",  PDF::Name("Form"));
+
+            PDF::Array bbox;
+            bbox.append(PDF::Number(info.cropBox.left()));
+            bbox.append(PDF::Number(info.cropBox.top()));
+            bbox.append(PDF::Number(info.cropBox.right()));
+            bbox.append(PDF::Number(info.cropBox.bottom()));
+            xObj.dict().insert("BBox",     bbox);
+            xObj.setStream(" ");
+            xObj.dict().insert("Length",   PDF::Number(xObj.stream().length()));
+            writer.writeObject(xObj);
+        }
+    }
+    // ..........................................
+
+    writeCatalog(&writer, pages, objNumOffset);
+    file.close();
+
+    const int total = pages.count();
+    const bool lazy = total > LAZY_IMPORT_PAGES;
+
+    if (lazy)
+        emit pagesReady();
+
+    // Pages ....................................
+    QVector<bool> imported(total, false);
+    int ready = 0;
+    int next = 0;
+    int priority = -1;
+    bool urgent = false;
+
+    QByteArray data;
+    QBuffer buf(&data);
+    QVector<int> chunkPages;
+    QScopedPointer<PDF::Writer> chunkWriter;
+    QElapsedTimer chunkTimer;
+    QElapsedTimer progressTimer;
+    progressTimer.start();
+
+    while (ready < total && !isCanceled())
+    {
+        if (mPriorityPage.load() != priority)
+        {
+            priority = mPriorityPage.load();
+            next = qBound(0, priority, total - 1);
+            urgent = true;
+        }
+
+        while (imported.at(next))
+            next = (next + 1) % total;
+
+        if (!chunkWriter)
+        {
+            data.clear();
+            buf.open(QBuffer::WriteOnly);
+            chunkWriter.reset(new PDF::Writer(&buf));
+            chunkTimer.start();
+        }
+
+        int job = std::upper_bound(jobPageStart.constBegin(), jobPageStart.constEnd(), next) - jobPageStart.constBegin() - 1;
+        procs.at(job)->writePage(chunkWriter.data(), next - jobPageStart.at(job));
+        imported[next] = true;
+        chunkPages << next;
+        ++ready;
+
+        if (progressTimer.elapsed() > 100)
+        {
+            progressTimer.restart();
+            emit progress(ready, total);
+        }
+
+        bool flush = (ready == total) ||
+                     (lazy && chunkTimer.elapsed() > (urgent ? CHUNK_TIME_URGENT : CHUNK_TIME));
+
+        if (flush)
+        {
+            Chunk chunk;
+            chunk.xref = chunkWriter->xRefTable();
+            chunkWriter.reset();
+            buf.close();
+            chunk.data = data;
+            chunk.pages = chunkPages;
+            chunkPages.clear();
+
+            addChunk(chunk);
+            urgent = false;
+        }
+    }
+    qDeleteAll(procs);
+    // ..........................................
+
+    if (!lazy && !isCanceled())
+        emit pagesReady();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PdfMerger::writeCatalog(PDF::Writer *writer, const QVector<PdfPageInfo> &pages, qint32 firstFreeNum)
 {
     // Catalog object ...........................
     PDF::Object catalog;
@@ -197,7 +645,7 @@ void TmpPdfFile::writeCatalog(PDF::Writer *writer, const QVector<PdfPageInfo> &p
         PDF::Object pagesObj(2);
         pagesObj.dict().insert("Type",  PDF::Name("Pages"));
 
-        PDF::ObjNum pageNum = writer->xRefTable().maxObjNum() + 1;
+        PDF::ObjNum pageNum = firstFreeNum;
         PDF::Array kids;
         for (int i=0; i< pages.count(); ++i)
         {
@@ -265,8 +713,10 @@ void TmpPdfFile::writeCatalog(PDF::Writer *writer, const QVector<PdfPageInfo> &p
     }
     // ..........................................
 
+    // The numbers below firstFreeNum are reserved for the pages
+    // which are not imported yet.
     mOrigXrefPos  = writer->device()->pos();
-    mFirstFreeNum = writer->xRefTable().maxObjNum() + 1;
+    mFirstFreeNum = qMax(writer->xRefTable().maxObjNum() + 1, firstFreeNum);
 
     writer->writeXrefTable();
     writer->writeTrailer(PDF::Link(catalog.objNum()));
@@ -279,24 +729,172 @@ void TmpPdfFile::writeCatalog(PDF::Writer *writer, const QVector<PdfPageInfo> &p
 /************************************************
 
  ************************************************/
-void TmpPdfFile::updateSheets(const QList<Sheet *> &sheets)
+void TmpPdfFile::updateSheets(const QList<Sheet *> &sheets, int first, int count)
 {
     if (mValid)
     {
-        QFile file(mFileName);
-        if (!file.open(QFile::ReadWrite))
-        {
-            project->error(tr("I can't create temporary file \"%1\"")
-                           .arg(mFileName));
-            return;
-        }
+        QVector<QByteArray> objects;
+        getTailObjects(&objects, sheets, first, count);
+        writeTail(objects);
+        mSheetsObjects = objects;
+    }
+}
+
+
+/************************************************
+ * The merged jobs are at the start of the file, the
+ * sheets tail is written after them from scratch. The
+ * generated objects are reused if their numbers are kept.
+ ************************************************/
+void TmpPdfFile::setMergedPart(qint64 fileSize, qint64 xrefPos, qint32 firstFreeNum)
+{
+    if (firstFreeNum != mFirstFreeNum)
+        mSheetsObjects.clear();
+
+    mOrigFileSize = fileSize;
+    mOrigXrefPos  = xrefPos;
+    mFirstFreeNum = firstFreeNum;
+
+    mTailObjects.clear();
+    mTailSections = 0;
+}
+
+
+/************************************************
+ * Only the objects which differ from the ones already in the file
+ * are appended as a new incremental update section. When the
+ * sections pile up or the objects were removed, the tail is
+ * compacted: the file is truncated back to the merged jobs and
+ * the whole tail is written again, so /Size fits the objects.
+ ************************************************/
+void TmpPdfFile::writeTail(const QVector<QByteArray> &objects)
+{
+    QFile file(mFileName);
+    if (!file.open(QFile::ReadWrite))
+    {
+        project->error(tr("I can't create temporary file \"%1\"")
+                       .arg(mFileName));
+        return;
+    }
+
+    bool compact = mTailSections == 0 ||
+                   mTailSections >= MAX_TAIL_SECTIONS ||
+                   objects.count() < mTailObjects.count() ||
+                   file.size() - mOrigFileSize > qMax(mCompactTailSize * MAX_TAIL_GROWTH, MIN_TAIL_SIZE);
+
+    qint64 prevXRefPos;
+    if (compact)
+    {
+        mTailObjects.clear();
+        mTailSections = 0;
+        prevXRefPos = mOrigXrefPos;
         file.seek(mOrigFileSize);
+    }
+    else
+    {
+        prevXRefPos = mLastXrefPos;
+        file.seek(file.size());
+    }
+
+    if (mTailObjects.count() < objects.count())
+        mTailObjects.resize(objects.count());
+
+    QMap<int, qint64> xref;
+    for (int i=0; i<objects.count(); ++i)
+    {
+        if (mTailObjects.at(i) == objects.at(i))
+            continue;
+
+        xref.insert(mFirstFreeNum + i, file.pos());
+        file.write(objects.at(i));
+        mTailObjects[i] = objects.at(i);
+    }
 
-        writeSheets(&file, sheets);
+    if (!xref.isEmpty() || compact)
+    {
+        mLastXrefPos = writeXRef(&file, xref, prevXRefPos, mFirstFreeNum + mTailObjects.count());
+        ++mTailSections;
+    }
 
+    if (compact)
+    {
         file.resize(file.pos());
-        file.close();
-   }
+        mCompactTailSize = file.pos() - mOrigFileSize;
+    }
+
+    file.close();
+}
+
+
+/************************************************
+ * Copies the first len bytes of the src to the current position
+ * of the out without passing the data through the user space.
+ * On Btrfs/XFS the blocks are shared (FICLONERANGE), otherwise
+ * the kernel copies them with copy_file_range(2).
+ * Returns the number of copied bytes, the caller should copy
+ * the rest of the data in the usual way.
+ ************************************************/
+static qint64 copyFileRange(QFile *src, QIODevice *out, qint64 len)
+{
+#ifdef Q_OS_LINUX
+    QFileDevice *dest = qobject_cast<QFileDevice*>(out);
+    if (!dest || dest->isSequential() || dest->handle() < 0 || src->handle() < 0)
+        return 0;
+
+    if (!dest->flush())
+        return 0;
+
+    const int srcFd  = src->handle();
+    const int destFd = dest->handle();
+    const qint64 destStart = dest->pos();
+    qint64 done = 0;
+
+#ifdef FICLONERANGE
+    // The cloned range should be aligned to the block size,
+    // the unaligned tail is copied by copy_file_range.
+    struct stat st;
+    if (fstat(destFd, &st) == 0 && st.st_blksize > 0 && destStart % st.st_blksize == 0)
+    {
+        struct file_clone_range range;
+        range.src_fd      = srcFd;
+        range.src_offset  = 0;
+        range.src_length  = len - len % st.st_blksize;
+        range.dest_offset = destStart;
+
+        if (range.src_length > 0 && ioctl(destFd, FICLONERANGE, &range) == 0)
+            done = range.src_length;
+    }
+#endif
+
+#ifdef SYS_copy_file_range
+    while (done < len)
+    {
+        loff_t srcOffset  = done;
+        loff_t destOffset = destStart + done;
+        ssize_t n = syscall(SYS_copy_file_range,
+                            srcFd,  &srcOffset,
+                            destFd, &destOffset,
+                            size_t(len - done), 0u);
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            break;
+
+        done += n;
+    }
+#endif
+
+    if (done && !dest->seek(destStart + done))
+        return -1;
+
+    return done;
+#else
+    Q_UNUSED(src)
+    Q_UNUSED(out)
+    Q_UNUSED(len)
+    return 0;
+#endif
 }
 
 
@@ -305,10 +903,17 @@ void TmpPdfFile::updateSheets(const QList<Sheet *> &sheets)
  ************************************************/
 bool TmpPdfFile::writeDocument(const QList<Sheet*> &sheets, QIODevice *out)
 {
+    finishImport();
+
     QFile f(mFileName);
     if (!f.open(QFile::ReadOnly))
         return project->error(tr("I can't read file '%1'").arg(mFileName) + "\n" + out->errorString());
 
+    // Fast path: reflink or in-kernel copy, the loop below is a fallback.
+    qint64 copied = copyFileRange(&f, out, mOrigFileSize);
+    if (copied < 0 || !f.seek(copied))
+        return project->error(tr("I can't write to file '%1'").arg(mFileName) + "\n" + out->errorString());
+
 
     qint64 bufLen = qMin(mOrigFileSize - f.pos(), (qint64)(1024 * 1024));
     while (bufLen > 0)
@@ -326,60 +931,229 @@ bool TmpPdfFile::writeDocument(const QList<Sheet*> &sheets, QIODevice *out)
 
 
 /************************************************
+ * Appends the integer without a temporary string.
+ ************************************************/
+void appendInt(QByteArray *out, qint64 value)
+{
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    char *p = end;
+
+    bool neg = value < 0;
+    quint64 v = neg ? 0 - quint64(value) : quint64(value);
+    do
+    {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (neg)
+        *--p = '-';
+
+    out->append(p, end - p);
+}
+
 
+/************************************************
+ * Appends the number with up to 6 decimal places,
+ * trailing zeros are dropped: 1.500 => 1.5, 2.000 => 2
  ************************************************/
-void TmpPdfFile::writeSheets(QIODevice *out, const QList<Sheet *> &sheets) const
+void appendNum(QByteArray *out, double value, int decimals = NUM_DECIMALS)
 {
-    qint32 rootNum = mFirstFreeNum;
-    qint32 metaDataNum = rootNum + 1;
-    qint32 pagesNum = metaDataNum + 1;
+    static const qint64 scales[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+    decimals = qBound(0, decimals, 6);
+    const qint64 scale = scales[decimals];
 
-    QMap<int, qint64> xref;
-    QStringList pagesKids;
+    qint64 v = qRound64(value * scale);
+    if (v < 0)
+    {
+        out->append('-');
+        v = -v;
+    }
+
+    appendInt(out, v / scale);
+
+    qint64 frac = v % scale;
+    if (frac)
+    {
+        char buf[7];
+        buf[0] = '.';
+        for (int i=decimals; i>0; --i)
+        {
+            buf[i] = char('0' + frac % 10);
+            frac /= 10;
+        }
+
+        int len = decimals + 1;
+        while (buf[len - 1] == '0')
+            --len;
+        out->append(buf, len);
+    }
+}
+
+
+/************************************************
+ * Everything the page placement depends on, for the one
+ * layout, printer and project rotation used by writeSheets().
+ ************************************************/
+struct PageMatrixKey
+{
+    int slot;
+    QRectF rect;
+    Rotation pdfRotation;
+    Rotation manualRotation;
+
+    bool operator==(const PageMatrixKey &other) const
+    {
+        return slot           == other.slot &&
+               rect           == other.rect &&
+               pdfRotation    == other.pdfRotation &&
+               manualRotation == other.manualRotation;
+    }
+};
+
+inline uint qHash(const PageMatrixKey &key, uint seed = 0)
+{
+    return qHash(key.slot, seed) ^
+           qHash(key.rect.left())  ^ (qHash(key.rect.top())    << 1) ^
+           qHash(key.rect.width()) ^ (qHash(key.rect.height()) << 2) ^
+           (uint(key.pdfRotation) << 3) ^ (uint(key.manualRotation) << 12);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+static QTransform pageMatrix(const Sheet *sheet, int slot, const ProjectPage *page, const QRectF &paperRect)
+{
+    TransformSpec spec = project->layout()->transformSpec(sheet, slot, project->rotation());
+    return spec.pageMatrix(page->rect(), paperRect);
+}
+
+
+/************************************************
+ * Generates the objects of the sheets tail: catalog, metadata,
+ * pages and 3 objects (page, resources, contents) per sheet.
+ * The object number of objects[i] is mFirstFreeNum + i, so each
+ * sheet always gets the same object numbers. The objects of the
+ * unchanged sheets are taken from mSheetsObjects, the sheets
+ * after the changed ones only if the sheet count is the same.
+ ************************************************/
+void TmpPdfFile::getTailObjects(QVector<QByteArray> *objects, const QList<Sheet *> &sheets, int first, int count) const
+{
+    const qint32 rootNum = mFirstFreeNum;
+    const qint32 metaDataNum = rootNum + 1;
+    const qint32 pagesNum = metaDataNum + 1;
+
+    objects->resize(3 + sheets.count() * 3);
+    QByteArray *obj = objects->data();
 
     // Catalog object ...........................
-    xref.insert(rootNum, out->pos());
-    *out << rootNum << " 0 obj\n";
-    *out << "<<\n";
-    *out << "/Type /Catalog\n";
-    //*out << "/Metadata " << metaDataNum << " 0 R\n";
-    *out << "/Pages " << pagesNum << " 0 R\n";
-    *out << ">>\n";
-    *out << "endobj\n";
+    obj->reserve(64);
+    appendInt(obj, rootNum);
+    obj->append(" 0 obj\n"
+                "<<\n"
+                "/Type /Catalog\n"
+                "/Pages ");
+    appendInt(obj, pagesNum);
+    obj->append(" 0 R\n"
+                ">>\n"
+                "endobj\n");
+    ++obj;
+    // ..........................................
+
+    // MetaData dictionary ......................
+    appendInt(obj, metaDataNum);
+    obj->append(" 0 obj\n"
+                "<<\n");
+    obj->append(project->metaData().asPDFDict());
+    obj->append(">>\n"
+                "endobj\n");
+    ++obj;
+    // ..........................................
+
+    // Pages object .............................
+    QRectF mediaBox = project->printer()->paperRect();
+
+    QByteArray *pagesObj = obj;
+    ++obj;
+
+    appendInt(pagesObj, pagesNum);
+    pagesObj->append(" 0 obj\n"
+                     "<<\n"
+                     "/Type /Pages\n"
+                     "/MediaBox [");
+    appendNum(pagesObj, mediaBox.left());   pagesObj->append(' ');
+    appendNum(pagesObj, mediaBox.top());    pagesObj->append(' ');
+    appendNum(pagesObj, mediaBox.width());  pagesObj->append(' ');
+    appendNum(pagesObj, mediaBox.height()); pagesObj->append("]\n");
+    pagesObj->append("/Count ");
+    appendInt(pagesObj, sheets.count());
+    pagesObj->append("\n/Kids [ ");
+    for (int i=0; i<sheets.count(); ++i)
+    {
+        appendInt(pagesObj, pagesNum + 1 + i * 3);
+        pagesObj->append(" 0 R\n");
+    }
+    pagesObj->append(" ]\n"
+                     ">>\n"
+                     "endobj\n");
     // ..........................................
 
     // Page objects .............................
+    PageMatrixCache matrixCache;
+    QByteArray buf;
+    buf.reserve(1024);
+
     qint32 num = pagesNum + 1;
-    foreach(const Sheet *sheet, sheets)
+    for (int s=0; s<sheets.count(); ++s)
     {
+        const Sheet *sheet = sheets.at(s);
         int pageNum      = num;
         int resourcesNum = num + 1;
         int contentsNum  = num + 2;
         num += 3;
 
+        // The objects of the unchanged sheet were generated before.
+        int index = obj - objects->data();
+        bool reuse = s < first ?
+                    index + 3 <= mSheetsObjects.count() :
+                    count > -1 && s >= first + count && mSheetsObjects.count() == objects->count();
+
+        if (reuse)
+        {
+            *obj++ = mSheetsObjects.at(index);
+            *obj++ = mSheetsObjects.at(index + 1);
+            *obj++ = mSheetsObjects.at(index + 2);
+            continue;
+        }
+
 
         // Page ............................
-        xref.insert(pageNum, out->pos());
-        *out << pageNum << " 0 obj\n";
-        *out << "<<\n";
-        *out << "/Type /Page\n";
-        *out << "/Contents "  << contentsNum  << " 0 R\n";
-        *out << "/Resources " << resourcesNum << " 0 R\n";
-        *out << "/Parent " << pagesNum << " 0 R\n";
-
-        *out << "/Rotate " << (int)sheet->rotation() << "\n";
-        *out << ">>\n";
-        *out << "endobj\n";
-
-        pagesKids << QString("%1 0 R").arg(pageNum);
+        appendInt(obj, pageNum);
+        obj->append(" 0 obj\n"
+                    "<<\n"
+                    "/Type /Page\n"
+                    "/Contents ");
+        appendInt(obj, contentsNum);
+        obj->append(" 0 R\n/Resources ");
+        appendInt(obj, resourcesNum);
+        obj->append(" 0 R\n/Parent ");
+        appendInt(obj, pagesNum);
+        obj->append(" 0 R\n/Rotate ");
+        appendInt(obj, sheet->rotation());
+        obj->append("\n"
+                    ">>\n"
+                    "endobj\n");
+        ++obj;
         //..................................
 
 
         // Resources .......................
-        xref.insert(resourcesNum, out->pos());
-        *out << resourcesNum << " 0 obj\n";
-        *out << "<<\n";
-        *out << "/XObject << ";
+        appendInt(obj, resourcesNum);
+        obj->append(" 0 obj\n"
+                    "<<\n"
+                    "/XObject << ");
         for (int i=0; i< sheet->count(); ++i)
         {
             const ProjectPage *page = sheet->page(i);
@@ -388,94 +1162,94 @@ void TmpPdfFile::writeSheets(QIODevice *out, const QList<Sheet *> &sheets) const
 
             for (int j=0; j<page->pdfInfo().xObjNums.count(); ++j)
             {
-                *out << "/Im" << i << "_" << j << " " << page->pdfInfo().xObjNums.at(j) <<  " 0 R ";
+                obj->append("/Im");
+                appendInt(obj, i);
+                obj->append('_');
+                appendInt(obj, j);
+                obj->append(' ');
+                appendInt(obj, page->pdfInfo().xObjNums.at(j));
+                obj->append(" 0 R ");
             }
         }
-        *out << ">>\n";
-
-        *out << "/ProcSet [ /PDF ]\n";
-        *out << ">>\n";
-        *out << "endobj\n";
+        obj->append(">>\n"
+                    "/ProcSet [ /PDF ]\n"
+                    ">>\n"
+                    "endobj\n");
+        ++obj;
         //..................................
 
 
         // Contents ........................
-        QString buf;
-        getPageStream(&buf, sheet);
-
-        xref.insert(contentsNum, out->pos());
-        *out << contentsNum << " 0 obj\n";
-        *out << "<<\n";
-        *out << "/Length " << buf.size() << "\n";
-        *out << ">>\n";
-        *out << "stream\n";
-        *out << buf;
-        *out << "endstream\n";
-        *out << "endobj\n";
+        buf.resize(0);
+        getPageStream(&buf, sheet, &matrixCache);
+
+        obj->reserve(buf.size() + 64);
+        appendInt(obj, contentsNum);
+        obj->append(" 0 obj\n"
+                    "<<\n"
+                    "/Length ");
+        appendInt(obj, buf.size());
+        obj->append("\n"
+                    ">>\n"
+                    "stream\n");
+        obj->append(buf);
+        obj->append("endstream\n"
+                    "endobj\n");
+        ++obj;
         //..................................
     }
     // ..........................................
+}
 
 
-    // Pages object .............................
-    QRectF mediaBox = project->printer()->paperRect();
-
-    xref.insert(pagesNum, out->pos());
-    *out << pagesNum << " 0 obj\n";
-    *out << "<<\n";
-    *out << "/Type /Pages\n";
-    *out << QString("/MediaBox [%1 %2 %3 %4]\n")
-            .arg(mediaBox.left())
-            .arg(mediaBox.top())
-            .arg(mediaBox.width())
-            .arg(mediaBox.height());
-
-    *out << "/Count " << sheets.count() << "\n";
-    *out << "/Kids [ " << pagesKids.join("\n") << " ]\n";
-    *out << ">>\n";
-    *out << "endobj\n";
-    // ..........................................
-
-    // MetaData dictionary ......................
-    xref.insert(metaDataNum, out->pos());
-    *out << metaDataNum << " 0 obj\n";
-    *out << "<<\n";
-    out->write(project->metaData().asPDFDict());
-    *out << ">>\n";
-    *out << "endobj\n";
-
-    /*
-    QByteArray metaData = project->metaData().asXMP();
-    xref.insert(metaDataNum, out->pos());
-    *out << metaDataNum << " 0 obj\n";
-    *out << "<<\n";
-    *out << "/Length " << metaData.length() << "\n";
-    *out << "/Subtype /XML\n";
-    *out << "/Type /Metadata\n";
-    *out << ">>\n";
-    *out << "stream\n";
-    out->write(metaData);
-    *out << "endstream\n";
-    *out << "endobj\n";
-    */
-    // ..........................................
-
-    // XRef for old objects .....................
+/************************************************
+ * Writes the xref section for the objects in the xref, the trailer
+ * and startxref. Returns the position of the xref section.
+ ************************************************/
+qint64 TmpPdfFile::writeXRef(QIODevice *out, const QMap<int, qint64> &xref, qint64 prevXRefPos, qint32 size) const
+{
     qint64 xrefPos = out->pos();
     *out << "xref\n";
-    *out << "0 3\n";
-    *out << "0000000001 65535 f \n";
-    *out << "0000000002 00000 f \n";
-    *out << "0000000000 00000 f \n";
+
+    // XRef for old objects .....................
+    // The first section over the merged file marks its catalog and
+    // pages as free, the later ones only update the sheets tail.
+    if (prevXRefPos == mOrigXrefPos)
+    {
+        *out << "0 3\n";
+        *out << "0000000001 65535 f \n";
+        *out << "0000000002 00000 f \n";
+        *out << "0000000000 00000 f \n";
+    }
    // ..........................................
 
     // XRef for new objects .....................
+    QByteArray buf;
     QMap<int, qint64>::const_iterator i = xref.constBegin();
-    *out << rootNum << " " << xref.count() << "\n";
     while (i != xref.constEnd())
     {
-        *out << QString("%1").arg(i.value(), 10, 10, QChar('0')) << " 00000 n \n";
-        ++i;
+        // Subsection of the consecutive object numbers
+        QMap<int, qint64>::const_iterator end = i;
+        int count = 0;
+        while (end != xref.constEnd() && end.key() == i.key() + count)
+        {
+            ++end;
+            ++count;
+        }
+
+        buf.resize(0);
+        appendInt(&buf, i.key());
+        buf.append(' ');
+        appendInt(&buf, count);
+        buf.append('\n');
+
+        for (; i != end; ++i)
+        {
+            char entry[21];
+            qsnprintf(entry, sizeof(entry), "%010lld 00000 n \n", i.value());
+            buf.append(entry, 20);
+        }
+        out->write(buf);
     }
     // ..........................................
 
@@ -484,10 +1258,10 @@ void TmpPdfFile::writeSheets(QIODevice *out, const QList<Sheet *> &sheets) const
     QString hash = QCryptographicHash::hash(mFileName.toLocal8Bit(), QCryptographicHash::Md5).toHex();
     *out << "trailer\n";
     *out << "<<\n";
-    *out << "/Size " << (rootNum + xref.count()) << "\n";
-    *out << "/Prev " << mOrigXrefPos << "\n";
-    *out << "/Root " << rootNum << " 0 R\n";
-    *out << "/Info " << metaDataNum << " 0 R\n";
+    *out << "/Size " << size << "\n";
+    *out << "/Prev " << prevXRefPos << "\n";
+    *out << "/Root " << mFirstFreeNum << " 0 R\n";
+    *out << "/Info " << (mFirstFreeNum + 1) << " 0 R\n";
     *out << QString("/ID [<%1> <%1>]\n").arg(hash);
     *out << ">>\n";
 
@@ -495,95 +1269,195 @@ void TmpPdfFile::writeSheets(QIODevice *out, const QList<Sheet *> &sheets) const
     *out << xrefPos << "\n";
     *out << "%%EOF\n";
     // ..........................................
+
+    return xrefPos;
 }
 
 
 /************************************************
 
  ************************************************/
-void TmpPdfFile::getPageStream(QString *out, const Sheet *sheet) const
+void TmpPdfFile::writeSheets(QIODevice *out, const QList<Sheet *> &sheets) const
 {
-    Printer * printer = project->printer();
+    QVector<QByteArray> objects;
+    getTailObjects(&objects, sheets);
 
-    for(int i=0; i<sheet->count(); ++i)
+    QMap<int, qint64> xref;
+    for (int i=0; i<objects.count(); ++i)
     {
-        const ProjectPage *page = sheet->page(i);
+        xref.insert(mFirstFreeNum + i, out->pos());
+        out->write(objects.at(i));
+    }
 
-        if (page)
+    writeXRef(out, xref, mOrigXrefPos, mFirstFreeNum + objects.count());
+}
+
+
+/************************************************
+ * Appends the pages imported by the merger to the merged part
+ * of the file as a new update section. The sheets tail is
+ * overwritten, the caller should call updateSheets() again.
+ ************************************************/
+bool TmpPdfFile::appendChunks(const QList<PdfMerger::Chunk> &chunks)
+{
+    if (chunks.isEmpty())
+        return false;
+
+    QFile file(mFileName);
+    if (!file.open(QFile::ReadWrite))
+    {
+        project->error(tr("I can't create temporary file \"%1\"")
+                       .arg(mFileName));
+        return false;
+    }
+    file.seek(mOrigFileSize);
+
+    PDF::XRefTable xref;
+    foreach (const PdfMerger::Chunk &chunk, chunks)
+    {
+        qint64 start = file.pos();
+        file.write(chunk.data);
+
+        foreach (const PDF::XRefEntry &entry, chunk.xref)
         {
+            if (entry.type() == PDF::XRefEntry::Used)
+                xref.addUsedObject(entry.objNum(), entry.genNum(), start + entry.pos());
+        }
+    }
 
-            TransformSpec spec = project->layout()->transformSpec(sheet, i, project->rotation());
-            QRectF paperRect = printer->paperRect();
+    QByteArray buf;
+    qint64 xrefPos = file.pos();
+    buf.append("xref\n");
 
-            double dx = 0;
-            double dy = 0;
+    PDF::XRefTable::const_iterator i = xref.constBegin();
+    while (i != xref.constEnd())
+    {
+        // Subsection of the consecutive object numbers
+        PDF::XRefTable::const_iterator end = i;
+        int count = 0;
+        while (end != xref.constEnd() && end.key() == i.key() + count)
+        {
+            ++end;
+            ++count;
+        }
 
-            switch (spec.rotation)
-            {
-            case NoRotate:
-                dx = spec.rect.left();
-                dy = paperRect.height() - spec.rect.bottom();
-                break;
-
-            case Rotate90:
-                dx = spec.rect.left();
-                dy = paperRect.height() - spec.rect.top();
-                break;
-
-            case Rotate180:
-                dx = spec.rect.right();
-                dy = paperRect.height() - spec.rect.top();
-                break;
-
-            case Rotate270:
-                dx = spec.rect.right();
-                dy = paperRect.height() - spec.rect.bottom();
-                break;
-            }
+        appendInt(&buf, i.key());
+        buf.append(' ');
+        appendInt(&buf, count);
+        buf.append('\n');
 
+        for (; i != end; ++i)
+        {
+            char entry[21];
+            qsnprintf(entry, sizeof(entry), "%010llu %05u n \n", i.value().pos(), uint(i.value().genNum()));
+            buf.append(entry, 20);
+        }
+    }
 
-            // Translate ........................
-            *out += QString("q\n1 0 0 1 %1 %2 cm\n")
-                    .arg(dx, 0, 'f', 3)
-                    .arg(dy, 0, 'f', 3);
+    buf.append("trailer\n"
+               "<<\n"
+               "/Size ");
+    appendInt(&buf, mFirstFreeNum);
+    buf.append("\n/Prev ");
+    appendInt(&buf, mOrigXrefPos);
+    buf.append("\n/Root 1 0 R\n"
+               ">>\n"
+               "startxref\n");
+    appendInt(&buf, xrefPos);
+    buf.append("\n%%EOF\n");
+    file.write(buf);
+
+    qint64 fileSize = file.pos();
+    file.resize(fileSize);
+    file.close();
+
+    // The tail is gone, the next updateSheets() writes it from scratch.
+    setMergedPart(fileSize, xrefPos, mFirstFreeNum);
+    return true;
+}
 
-            // Rotate ...........................
-            *out += QString("q\n%1 %2 %3 %4 0 0 cm\n")
-                    .arg( cos(- spec.rotation * M_PI / 180), 0, 'f', 3)
-                    .arg( sin(- spec.rotation * M_PI / 180), 0, 'f', 3)
-                    .arg(-sin(- spec.rotation * M_PI / 180), 0, 'f', 3)
-                    .arg( cos(- spec.rotation * M_PI / 180), 0, 'f', 3);
 
-            // Scale ...........................
-            *out += QString("q\n%1 0 0 %1 0 0 cm\n")
-                    .arg(spec.scale, 0, 'f', 3);
+/************************************************
+ * The project pages written by the chunks.
+ ************************************************/
+QList<ProjectPage*> TmpPdfFile::chunksPages(const QList<PdfMerger::Chunk> &chunks) const
+{
+    QSet<int> imported;
+    foreach (const PdfMerger::Chunk &chunk, chunks)
+    {
+        foreach (int n, chunk.pages)
+            imported << n;
+    }
 
-            QRectF rect = page->rect();
+    QList<ProjectPage*> res;
+    for (int j=0; j<mJobs.count() && j<mJobPageStart.count(); ++j)
+    {
+        const Job &job = mJobs.at(j);
+        for (int p=0; p<job.pageCount(); ++p)
+        {
+            ProjectPage *page = job.page(p);
+            if (page->jobPageNum() < 0)
+                continue;
 
-            // Translate for page rect(x1,y1) ..
-            *out += QString("q\n1 0 0 1 %1 %2 cm\n")
-                    .arg(-rect.left(), 0, 'f', 3)
-                    .arg(-rect.top(), 0, 'f', 3);
+            if (imported.contains(mJobPageStart.at(j) + page->jobPageNum()))
+                res << page;
+        }
+    }
 
+    return res;
+}
 
-            for (int j=0; j<page->pdfInfo().xObjNums.size(); ++j)
-                *out += QString("/Im%1_%2 Do\n").arg(i).arg(j);
 
+/************************************************
 
-            if (printer->drawBorder())
-            {
-                *out += QString("%1 %2 %3 %4 re\nS\n")
-                        .arg(rect.left(),   0, 'f', 3)
-                        .arg(rect.top(),    0, 'f', 3)
-                        .arg(rect.width(),  0, 'f', 3)
-                        .arg(rect.height(), 0, 'f', 3);
-            }
+ ************************************************/
+void TmpPdfFile::getPageStream(QByteArray *out, const Sheet *sheet, PageMatrixCache *cache) const
+{
+    Printer * printer = project->printer();
+    const QRectF paperRect = printer->paperRect();
+    const bool drawBorder = printer->drawBorder();
 
+    for(int i=0; i<sheet->count(); ++i)
+    {
+        const ProjectPage *page = sheet->page(i);
+        if (!page)
+            continue;
+
+        PageMatrixKey key = { i, page->rect(), page->pdfRotation(), page->manualRotation() };
+        PageMatrixCache::const_iterator it = cache->constFind(key);
+        if (it == cache->constEnd())
+            it = cache->insert(key, pageMatrix(sheet, i, page, paperRect));
+
+        const QTransform &m = it.value();
+
+        out->append("q\n");
+        // The scale and rotation terms multiply the page
+        // coordinates, they need more precision.
+        appendNum(out, m.m11(), MATRIX_DECIMALS); out->append(' ');
+        appendNum(out, m.m12(), MATRIX_DECIMALS); out->append(' ');
+        appendNum(out, m.m21(), MATRIX_DECIMALS); out->append(' ');
+        appendNum(out, m.m22(), MATRIX_DECIMALS); out->append(' ');
+        appendNum(out, m.dx());  out->append(' ');
+        appendNum(out, m.dy());  out->append(" cm\n");
+
+        for (int j=0; j<page->pdfInfo().xObjNums.size(); ++j)
+        {
+            out->append("/Im");
+            appendInt(out, i);
+            out->append('_');
+            appendInt(out, j);
+            out->append(" Do\n");
+        }
 
-            *out += "Q\n";
-            *out += "Q\n";
-            *out += "Q\n";
-            *out += "Q\n";
+        if (drawBorder)
+        {
+            QRectF rect = page->rect();
+            appendNum(out, rect.left());   out->append(' ');
+            appendNum(out, rect.top());    out->append(' ');
+            appendNum(out, rect.width());  out->append(' ');
+            appendNum(out, rect.height()); out->append(" re\nS\n");
         }
+
+        out->append("Q\n");
     }
 }
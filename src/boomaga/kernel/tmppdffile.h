@@ -29,11 +29,21 @@
 
 #include <QObject>
 #include <QVector>
+#include <QHash>
+#include <QMap>
+#include <QThread>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QWaitCondition>
 #include "boomagatypes.h"
+#include "pdfparser/pdfxref.h"
 
 class Sheet;
+class ProjectPage;
 class Job;
 class JobList;
+class QTransform;
+struct PageMatrixKey;
 
 namespace PDF {
     class Writer;
@@ -41,36 +51,169 @@ namespace PDF {
 
 #include "job.h"
 
+/************************************************
+ * Copies the pages of the jobs into the temporary
+ * file in its own thread.
+ *
+ * Big jobs are imported lazily: the merger reads the
+ * page trees, writes the file with empty placeholders
+ * for the pages and emits pagesReady(). Then the pages
+ * are imported in the background, the pages requested
+ * by setPriorityPage() go first. The imported objects
+ * are passed to the GUI thread in chunks, TmpPdfFile
+ * appends them to the file.
+ ************************************************/
+class PdfMerger: public QObject
+{
+    Q_OBJECT
+public:
+    struct Source
+    {
+        QString fileName;
+        qint64 startPos;
+        qint64 endPos;
+    };
+
+    struct Chunk
+    {
+        QByteArray data;
+        PDF::XRefTable xref;    // Positions are relative to the data
+        QVector<int> pages;     // Indexes of the pages over all jobs
+    };
+
+    PdfMerger(const QString &fileName, const QVector<Source> &sources);
+    virtual ~PdfMerger();
+
+    QThread *workerThread() { return &mThread; }
+
+    // Can be called from any thread, the merger checks the flag after each page.
+    void cancel() { mCanceled.store(1); }
+    bool isCanceled() const { return mCanceled.load(); }
+
+    // Index of the page over all jobs, can be called from any thread.
+    void setPriorityPage(int page) { mPriorityPage.store(page); }
+
+    // The results are valid after the pagesReady() signal.
+    const QVector<QVector<PdfPageInfo> > &pageInfo() const { return mPageInfo; }
+    qint32 firstFreeNum() const { return mFirstFreeNum; }
+    qint64 origFileSize() const { return mOrigFileSize; }
+    qint64 origXrefPos() const { return mOrigXrefPos; }
+
+    QList<Chunk> takeChunks();
+
+    // Blocks until new chunks are ready or the merger is done,
+    // returns true if it is done.
+    bool waitForChunks();
+    QString errorString() const;
+
+public slots:
+    void run();
+
+signals:
+    void progress(int progress, int all);
+    void pagesReady();
+    void chunksReady();
+    void finished();
+    void failed(const QString &message);
+
+private:
+    QString mFileName;
+    QVector<Source> mSources;
+    QThread mThread;
+    QAtomicInt mCanceled;
+    QAtomicInt mPriorityPage;
+
+    QVector<QVector<PdfPageInfo> > mPageInfo;
+    qint32 mFirstFreeNum;
+    qint64 mOrigFileSize;
+    qint64 mOrigXrefPos;
+
+    mutable QMutex mMutex;
+    QWaitCondition mChunksCond;
+    QList<Chunk> mChunks;
+    bool mDone;
+    QString mErrorString;
+
+    void merge();
+    void writeCatalog(PDF::Writer *writer, const QVector<PdfPageInfo> &pages, qint32 firstFreeNum);
+    void addChunk(const Chunk &chunk);
+};
+
+
 class TmpPdfFile: public QObject
 {
     Q_OBJECT
-    friend class PdfMerger;
 public:
     explicit TmpPdfFile(QObject *parent = 0);
     virtual ~TmpPdfFile();
 
     void merge(const JobList &jobs);
-    void updateSheets(const QList<Sheet *> &sheets);
+    void cancelMerge();
+
+    // The pages are imported in the background after merged(),
+    // see PdfMerger. Waits until all of them are in the file,
+    // the events except the user input are processed meanwhile.
+    void finishImport();
+    bool isImporting() const { return mMerger && mValid; }
+
+    // Only the sheets from first to first + count are changed, -1
+    // means all the sheets after first. The objects of the other
+    // sheets generated by the previous call are reused.
+    void updateSheets(const QList<Sheet *> &sheets, int first = 0, int count = -1);
 
     QString fileName() const { return mFileName; }
 
     bool writeDocument(const QList<Sheet*> &sheets, QIODevice *out);
     bool isValid() const { return mValid; }
 
+public slots:
+    void importFirst(Sheet *sheet);
+
+protected:
+    void setMergedPart(qint64 fileSize, qint64 xrefPos, qint32 firstFreeNum);
+
+    // Writes the sheets tail objects, see updateSheets().
+    void writeTail(const QVector<QByteArray> &objects);
+
 signals:
     void merged();
+    // The pages which were empty placeholders in the file.
+    void pagesImported(const QList<ProjectPage*> &pages);
     void progress(int progress, int all) const;
+    void error(const QString &message);
+
+private slots:
+    void mergerProgress(int progress, int all);
+    void mergerPagesReady();
+    void mergerChunksReady();
+    void mergerFinished();
+    void mergerFailed(const QString &message);
 
 private:
-    void getPageStream(QString *out, const Sheet *sheet) const;
+    typedef QHash<PageMatrixKey, QTransform> PageMatrixCache;
+    void getPageStream(QByteArray *out, const Sheet *sheet, PageMatrixCache *cache) const;
     void writeSheets(QIODevice *out, const QList<Sheet *> &sheets) const;
-    void writeCatalog(PDF::Writer *writer, const QVector<PdfPageInfo> &pages);
+    void getTailObjects(QVector<QByteArray> *objects, const QList<Sheet *> &sheets, int first = 0, int count = -1) const;
+    qint64 writeXRef(QIODevice *out, const QMap<int, qint64> &xref, qint64 prevXRefPos, qint32 size) const;
+    void stopMerger();
+    bool appendChunks(const QList<PdfMerger::Chunk> &chunks);
+    QList<ProjectPage*> chunksPages(const QList<PdfMerger::Chunk> &chunks) const;
 
     QString mFileName;
     qint32 mFirstFreeNum;
     qint64 mOrigFileSize;
     qint64 mOrigXrefPos;
     bool mValid;
+    JobList mJobs;
+    QVector<int> mJobPageStart;
+    PdfMerger *mMerger;
+
+    // Sheets tail objects as they are in the file, see updateSheets()
+    QVector<QByteArray> mTailObjects;     // Written to the file
+    QVector<QByteArray> mSheetsObjects;   // Generated by the last getTailObjects()
+    qint64 mLastXrefPos;
+    int mTailSections;
+    qint64 mCompactTailSize;
 };
 
 
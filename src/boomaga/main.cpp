@@ -28,9 +28,12 @@
 #include "gui/mainwindow.h"
 #include "dbus.h"
 #include "kernel/job.h"
+#include "batchrender.h"
+#include "settings.h"
 #include "../common.h"
 
 #include <QApplication>
+#include <QGuiApplication>
 #include <QTextStream>
 #include <QLocale>
 #include <QTranslator>
@@ -56,6 +59,13 @@ struct Args
 
     bool startedFromCups;
     stringList files;
+
+    // Batch mode, see BatchRender
+    string renderDir;
+    string layout;
+    string format;
+    int dpi;
+    int threads;
 };
 
 
@@ -77,6 +87,15 @@ void printHelp()
     out << "  -V, --version           Print program version" << endl;
     out << endl;
 
+    out << "Batch mode options:" << endl;
+    out << "  --render-sheets DIR     Render the sheets to the image files in DIR" << endl;
+    out << "                          without the GUI" << endl;
+    out << "  --layout LAYOUT         " << BatchRender::layoutIds().join(", ") << endl;
+    out << "  --dpi DPI               Image resolution, 150 by default" << endl;
+    out << "  --format FORMAT         png or ppm, png by default" << endl;
+    out << "  --threads COUNT         Render threads, the CPU count by default" << endl;
+    out << endl;
+
     out << "Arguments:" << endl;
     out << "  files                    One or more PDF files" << endl;
 
@@ -94,6 +113,25 @@ void printVersion()
 }
 
 
+/************************************************
+
+ ************************************************/
+int printError(const QString &msg);
+
+
+/************************************************
+
+ ************************************************/
+string argValue(int argc, char *argv[], int *i)
+{
+    if (*i + 1 >= argc)
+        exit(printError(QString("Option %1 requires a value").arg(argv[*i])));
+
+    ++(*i);
+    return argv[*i];
+}
+
+
 /************************************************
 
  ************************************************/
@@ -110,7 +148,10 @@ int printError(const QString &msg)
  *
  ************************************************/
 Args::Args(int argc, char *argv[]):
-    startedFromCups(false)
+    startedFromCups(false),
+    format("png"),
+    dpi(150),
+    threads(0)
 {
     for (int i = 1; i<argc; ++i)
     {
@@ -138,6 +179,45 @@ Args::Args(int argc, char *argv[]):
             continue;
         }
 
+        //*************************************************
+        if (arg == "--render-sheets")
+        {
+            renderDir = argValue(argc, argv, &i);
+            continue;
+        }
+
+        //*************************************************
+        if (arg == "--layout")
+        {
+            layout = argValue(argc, argv, &i);
+            continue;
+        }
+
+        //*************************************************
+        if (arg == "--dpi")
+        {
+            dpi = atoi(argValue(argc, argv, &i).c_str());
+            if (dpi <= 0)
+                exit(printError("Invalid DPI value"));
+            continue;
+        }
+
+        //*************************************************
+        if (arg == "--format")
+        {
+            format = argValue(argc, argv, &i);
+            if (format != "png" && format != "ppm")
+                exit(printError(QString("Unknown image format %1").arg(format.c_str())));
+            continue;
+        }
+
+        //*************************************************
+        if (arg == "--threads")
+        {
+            threads = atoi(argValue(argc, argv, &i).c_str());
+            continue;
+        }
+
         //*************************************************
         files.push_back(argv[i]);
     }
@@ -194,6 +274,43 @@ void cleanup()
 }
 
 
+/************************************************
+ * Renders the sheets without the GUI and DBus.
+ ************************************************/
+int renderSheets(int argc, char *argv[], const Args &args)
+{
+    if (args.files.empty())
+        return printError("No input files");
+
+    if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication application(argc, argv);
+    QObject::connect(&application, &QCoreApplication::aboutToQuit,
+                     &cleanup);
+
+    QString layout = QString::fromStdString(args.layout);
+    if (layout.isEmpty())
+        layout = settings->value(Settings::Layout).toString();
+
+    BatchRender batch(QString::fromStdString(args.renderDir), args.dpi, args.threads);
+    batch.setFormat(QString::fromStdString(args.format));
+    QObject::connect(&batch, &BatchRender::finished,
+                     &application, &QCoreApplication::exit, Qt::QueuedConnection);
+
+    QStringList files;
+    for (auto &f: args.files)
+    {
+        files << QString::fromStdString(f);
+    }
+
+    if (!batch.start(files, layout))
+        return 1;
+
+    return application.exec();
+}
+
+
 /************************************************
 
  ************************************************/
@@ -214,6 +331,10 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    // Batch mode ...............................
+    if (!args.renderDir.empty())
+        return renderSheets(argc, argv, args);
+
     // Start GUI ................................
     readEnvFile();
 
@@ -32,6 +32,10 @@
 #include "pdferrors.h"
 #include "pdfvalue.h"
 #include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QMutex>
+#include <QWaitCondition>
 #include <QTextCodec>
 #include <QDebug>
 
@@ -117,6 +121,7 @@ public:
     void clear();
 
 private:
+    mutable QMutex mMutex;
     QHash<quint64, QByteArray> mStreams;
 };
 
@@ -146,6 +151,7 @@ Reader::Cache::~Cache()
  ************************************************/
 const QByteArray Reader::Cache::getStream(PDF::ObjNum objNum, PDF::GenNum genNum) const
 {
+    QMutexLocker locker(&mMutex);
     return mStreams.value((quint64(objNum) << 32) + genNum);
 }
 
@@ -155,6 +161,7 @@ const QByteArray Reader::Cache::getStream(PDF::ObjNum objNum, PDF::GenNum genNum
  ************************************************/
 void Reader::Cache::setStream(ObjNum objNum, GenNum genNum, QByteArray stream)
 {
+    QMutexLocker locker(&mMutex);
     mStreams.insert((quint64(objNum) << 32) + genNum, stream);
 }
 
@@ -164,6 +171,7 @@ void Reader::Cache::setStream(ObjNum objNum, GenNum genNum, QByteArray stream)
  ************************************************/
 void Reader::Cache::clear()
 {
+    QMutexLocker locker(&mMutex);
     mStreams.clear();
 }
 
@@ -1325,6 +1333,134 @@ void Reader::open(const QString &fileName, quint64 startPos, quint64 endPos)
 }
 
 
+/************************************************
+ *
+ ************************************************/
+namespace {
+
+#define MAX_SHARED_READERS  16
+
+struct SharedReader
+{
+    QString fileName;
+    quint64 startPos;
+    quint64 endPos;
+    QDateTime modified;
+    qint64 size;
+    QSharedPointer<Reader> reader;
+    bool loading;                   // The reader is parsed by another thread
+};
+
+QMutex sharedReadersMutex;
+QWaitCondition sharedReadersLoaded;
+QList<SharedReader> sharedReaders;  // Most recently used first
+
+
+/************************************************
+ *
+ ************************************************/
+int indexOfSharedReader(const QSharedPointer<Reader> &reader)
+{
+    for (int i=0; i<sharedReaders.count(); ++i)
+    {
+        if (sharedReaders.at(i).reader == reader)
+            return i;
+    }
+
+    return -1;
+}
+
+}
+
+
+/************************************************
+ * The file is parsed without the lock. The placeholder
+ * makes the other threads wait for this reader instead
+ * of parsing the same file again.
+ ************************************************/
+QSharedPointer<Reader> Reader::shared(const QString &fileName, quint64 startPos, quint64 endPos)
+{
+    QFileInfo fi(fileName);
+    QString path = fi.absoluteFilePath();
+
+    QMutexLocker locker(&sharedReadersMutex);
+    for (int i=0; i<sharedReaders.count(); ++i)
+    {
+        const SharedReader &r = sharedReaders.at(i);
+        if (r.fileName != path || r.startPos != startPos || r.endPos != endPos)
+            continue;
+
+        // The list can be changed while waiting, it is searched again.
+        if (r.loading)
+        {
+            sharedReadersLoaded.wait(&sharedReadersMutex);
+            i = -1;
+            continue;
+        }
+
+        if (r.modified == fi.lastModified() && r.size == fi.size())
+        {
+            QSharedPointer<Reader> res = r.reader;
+            sharedReaders.move(i, 0);
+            return res;
+        }
+
+        // The file was modified
+        sharedReaders.removeAt(i);
+        break;
+    }
+
+    QSharedPointer<Reader> res(new Reader());
+    SharedReader r = { path, startPos, endPos, fi.lastModified(), fi.size(), res, true };
+    sharedReaders.prepend(r);
+
+    while (sharedReaders.count() > MAX_SHARED_READERS)
+        sharedReaders.removeLast();
+
+    locker.unlock();
+    try
+    {
+        res->open(fileName, startPos, endPos);
+        res->pageCount();   // Calculated once, so the reader doesn't change later
+    }
+    catch (...)
+    {
+        locker.relock();
+        int n = indexOfSharedReader(res);
+        if (n > -1)
+            sharedReaders.removeAt(n);
+
+        sharedReadersLoaded.wakeAll();
+        throw;
+    }
+
+    // The placeholder could be removed by releaseShared().
+    locker.relock();
+    int n = indexOfSharedReader(res);
+    if (n > -1)
+        sharedReaders[n].loading = false;
+
+    sharedReadersLoaded.wakeAll();
+    return res;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Reader::releaseShared(const QString &fileName)
+{
+    QString path = QFileInfo(fileName).absoluteFilePath();
+
+    QMutexLocker locker(&sharedReadersMutex);
+    for (int i=sharedReaders.count()-1; i>=0; --i)
+    {
+        if (sharedReaders.at(i).fileName == path)
+            sharedReaders.removeAt(i);
+    }
+}
+
+
 /************************************************
  *
  ************************************************/
@@ -28,6 +28,7 @@
 #define PDFREADER_H
 
 #include <QtGlobal>
+#include <QSharedPointer>
 #include <exception>
 #include "pdfvalue.h"
 #include "pdfxref.h"
@@ -89,6 +90,18 @@ public:
     /// Closes this reader for reading.
     void close();
 
+    /// Returns the opened reader for the file range. The readers are shared across
+    /// the application, the file is parsed again only if it was modified since.
+    /// The shared readers can be used from several threads: the reader is not
+    /// changed after load() and pageCount(), the const methods only read it and
+    /// the stream cache is guarded by its own mutex. Don't call open() or close()
+    /// for a shared reader.
+    static QSharedPointer<Reader> shared(const QString &fileName, quint64 startPos = 0, quint64 endPos = 0);
+
+    /// Removes the readers of the file from the shared readers. The reader is closed
+    /// when the last copy of the pointer is destroyed.
+    static void releaseShared(const QString &fileName);
+
     const XRefTable &xRefTable() const { return mXRefTable; }
     const Dict &trailerDict() const { return mTrailerDict; }
     Dict trailerDict() { return mTrailerDict; }
@@ -101,6 +114,12 @@ public:
 
     quint32 pageCount();
 
+    /// Returns the bytes of the document. The pointer is valid until the reader is closed.
+    const char *data() const { return mData; }
+
+    /// Returns the size of the document in bytes.
+    quint64 size() const { return mSize; }
+
     /// Constructs a QByteArray that uses len bytes from the data,
     /// starting at position pos. The bytes are not copied.
     /// The caller guarantees that reader will not be closed as long
@@ -27,48 +27,139 @@
 #include <poppler-document.h>
 #include <poppler-page-renderer.h>
 #include <poppler-page.h>
+#include <poppler-image.h>
 #include <QDebug>
 #include <QFile>
 #include <QFileInfo>
+#include <QPainter>
+#include <QDir>
+#include <QDateTime>
+#include <QDataStream>
+#include <QCryptographicHash>
+#include <QtMath>
+
+#ifdef HAVE_SNAPPY
+#include <snappy.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "kernel/project.h"
 #include "kernel/layout.h"
+#include "kernel/sheet.h"
+#include "settings.h"
+#include "pdfparser/pdfreader.h"
+#include "pdfparser/pdferrors.h"
+
+// Bigger files are loaded by poppler from the disk
+#define MAX_RAW_DATA_SIZE   qint64(256 * 1024 * 1024)
+
+// In kilobytes
+#define RASTER_CACHE_SIZE   (256 * 1024)
+
+// The resolution of the first fast pass for the visible sheet
+#define DRAFT_RESOLUTION    36
+
+// The visible sheets bigger than this are split into the tiles
+#define MIN_TILED_AREA      (1536 * 1536)
+#define TILE_SIZE           768
+
+// The disk cache is trimmed to this part of its budget
+#define DISK_CACHE_TRIM     0.8
+
+#define RASTER_FILE_MAGIC   quint32(0x42524331)     // "BRC1"
+#define MAX_RASTER_SIZE     quint32(32768)          // Pixels, the bigger entries are damaged
+
+// The parsed job documents kept by each worker
+#define MAX_JOB_DOCUMENTS   8
+
+// The worker thread is stopped and its documents are freed
+// when it has nothing to do for this time, in ms
+#define WORKER_IDLE_TIMEOUT 30000
+
+// The job pages are rasterized at the fixed resolution steps,
+// the layouts with near scales share the rasters.
+#define RASTER_STEPS_PER_OCTAVE 2
+
+//#define DEBUG_RENDER_MEMORY
+
+
+/************************************************
+ *
+ ************************************************/
+static void deletePopplerImage(void *image)
+{
+    delete static_cast<poppler::image*>(image);
+}
 
 
 /************************************************
+ * Rounds the resolution up to the raster step, the
+ * raster is downscaled when the sheet is composed.
+ ************************************************/
+static double rasterResolution(double resolution)
+{
+    if (resolution <= 0)
+        return resolution;
+
+    // The epsilon keeps the exact steps from rounding up.
+    double step = qLn(resolution) / qLn(2.0) * RASTER_STEPS_PER_OCTAVE;
+    return qPow(2.0, qCeil(step - 1e-6) / double(RASTER_STEPS_PER_OCTAVE));
+}
+
 
+/************************************************
+ * The QImage takes the poppler buffer without copying,
+ * the buffer is freed with the last copy of the QImage.
  ************************************************/
-QImage doRenderSheet(poppler::document *doc, int sheetNum, double resolution)
+static QImage toQImage(poppler::image &img)
 {
-    poppler::page *page = doc->create_page(sheetNum);
-    if (page)
+    QImage::Format format = QImage::Format_Invalid;
+
+    switch (img.format())
     {
-        poppler::page_renderer prender;
-        prender.set_render_hint(poppler::page_renderer::antialiasing, true);
-        prender.set_render_hint(poppler::page_renderer::text_antialiasing, true);
+    case poppler::image::format_invalid: format = QImage::Format_Invalid; break;
+    case poppler::image::format_mono:    format = QImage::Format_Mono;    break;
+    case poppler::image::format_rgb24:   format = QImage::Format_RGB32;   break;
+    case poppler::image::format_argb32:  format = QImage::Format_ARGB32;  break;
+    }
 
-        poppler::image img = prender.render_page(page, resolution, resolution);
+    if (format == QImage::Format_Invalid)
+        return QImage();
 
-        QImage::Format format = QImage::Format_Invalid;
+    // The poppler images are implicitly shared, so data() doesn't
+    // detach while img is the only owner of the buffer.
+    uchar *data = reinterpret_cast<uchar*>(img.data());
+    poppler::image *owner = new poppler::image(img);
 
-        switch (img.format())
-        {
-        case poppler::image::format_invalid: format = QImage::Format_Invalid; break;
-        case poppler::image::format_mono:    format = QImage::Format_Mono;    break;
-        case poppler::image::format_rgb24:   format = QImage::Format_RGB32;   break;
-        case poppler::image::format_argb32:  format = QImage::Format_ARGB32;  break;
-        }
+    return QImage(data,
+                  img.width(), img.height(),
+                  img.bytes_per_row(),
+                  format,
+                  deletePopplerImage, owner);
+}
 
 
-        QImage result;
-        if (format != QImage::Format_Invalid)
-        {
-            result = QImage(reinterpret_cast<const uchar*>(img.const_data()),
-                            img.width(), img.height(),
-                            img.bytes_per_row(),
-                            format).copy();
-        }
+/************************************************
+
+ ************************************************/
+QImage doRenderSheet(poppler::document *doc, int sheetNum, double resolution, const QRect &rect = QRect(), bool antialiasing = true)
+{
+    poppler::page *page = doc->create_page(sheetNum);
+    if (page)
+    {
+        poppler::page_renderer prender;
+        prender.set_render_hint(poppler::page_renderer::antialiasing, antialiasing);
+        prender.set_render_hint(poppler::page_renderer::text_antialiasing, antialiasing);
 
+        poppler::image img = rect.isNull() ?
+                    prender.render_page(page, resolution, resolution) :
+                    prender.render_page(page, resolution, resolution,
+                                        rect.left(), rect.top(), rect.width(), rect.height());
+
+        QImage result = toQImage(img);
         delete page;
         return result;
     }
@@ -78,86 +169,111 @@ QImage doRenderSheet(poppler::document *doc, int sheetNum, double resolution)
 
 
 /************************************************
- *
+ * Everything the sheet image depends on: the job
+ * pages and where they are placed.
  ************************************************/
-RenderWorker::RenderWorker(const QString &fileName, int resolution):
-    QObject(),
-    mSheetNum(0),
-    mResolution(resolution),
-    mBusy(false),
-    mPopplerDoc(0)
+QByteArray SheetComposition::key() const
 {
-    if (QFileInfo(fileName).exists())
-        mPopplerDoc = poppler::document::load_from_file(fileName.toLocal8Bit().data());
-}
+    QByteArray res;
+    QDataStream stream(&res, QIODevice::WriteOnly);
+    stream << paperRect << int(rotation) << drawBorder << pages.count();
 
+    foreach (const Page &page, pages)
+    {
+        stream << page.fileName
+               << page.startPos
+               << page.endPos
+               << page.jobPageNum
+               << page.pdfRotation
+               << page.rect
+               << page.matrix;
+    }
 
-/************************************************
- *
- ************************************************/
-RenderWorker::~RenderWorker()
-{
-    delete mPopplerDoc;
+    return QCryptographicHash::hash(res, QCryptographicHash::Sha1);
 }
 
 
 /************************************************
  *
  ************************************************/
-QImage RenderWorker::renderSheet(int sheetNum)
+QString PageRasterCache::diskFileName(const QByteArray &key) const
 {
-    if (!mPopplerDoc)
-        return QImage();
-
-    mBusy = true;
-    QImage img = doRenderSheet(mPopplerDoc, sheetNum, mResolution);
-    emit sheetReady(img, sheetNum);
-    mBusy = false;
-    return img;
+    return QString("%1/%2.raster").arg(mDiskDir, QString::fromLatin1(key.toHex()));
 }
 
 
 /************************************************
- *
+ * File format: magic, width, height, bytes per line,
+ * image format, compression, the compressed bits.
  ************************************************/
-QImage RenderWorker::renderPage(int sheetNum, const QRectF &pageRect, int pageNum)
+QImage PageRasterCache::diskImage(const QByteArray &key)
 {
-    if (!mPopplerDoc)
+    if (mDiskBudget <= 0)
         return QImage();
 
-    mBusy = true;
-    QImage img = doRenderSheet(mPopplerDoc, sheetNum, mResolution);
+    QFile file(diskFileName(key));
+    if (!file.open(QFile::ReadOnly))
+        return QImage();
 
-    QSizeF printerSize =  project->printer()->paperRect().size();
+    QDataStream stream(&file);
+    quint32 magic, width, height, bytesPerLine, format, compression;
+    stream >> magic >> width >> height >> bytesPerLine >> format >> compression;
+    QByteArray data;
+    stream >> data;
+    file.close();
 
-    if (isLandscape(project->rotation()))
-        printerSize.transpose();
+    if (stream.status() != QDataStream::Ok || magic != RASTER_FILE_MAGIC)
+        return QImage();
 
-    double scale = qMin(img.width() * 1.0 / printerSize.width(),
-                        img.height() * 1.0 / printerSize.height());
+    // The damaged header shouldn't allocate a huge image.
+    if (format != QImage::Format_RGB32 &&
+        format != QImage::Format_ARGB32 &&
+        format != QImage::Format_ARGB32_Premultiplied)
+        return QImage();
 
-    QSize size = QSize(pageRect.width()  * scale,
-                       pageRect.height() * scale);
+    if (width == 0 || height == 0 ||
+        width > MAX_RASTER_SIZE || height > MAX_RASTER_SIZE ||
+        quint64(bytesPerLine) != quint64(width) * 4 ||
+        data.isEmpty())
+        return QImage();
 
-    if (isLandscape(project->rotation()))
-        size.transpose();
+    QImage img(width, height, QImage::Format(format));
+    if (img.isNull() || quint32(img.bytesPerLine()) != bytesPerLine)
+        return QImage();
 
-    QRect rect(QPoint(0, 0), size);
-    if (isLandscape(project->rotation()))
+    // The decoded bits should fill the image exactly.
+    const size_t size = size_t(bytesPerLine) * height;
+    switch (compression)
     {
-        rect.moveRight(img.width() - pageRect.top()  * scale);
-        rect.moveTop(pageRect.left() * scale);
+#ifdef HAVE_SNAPPY
+    case 1:
+    {
+        size_t len = 0;
+        if (!snappy::GetUncompressedLength(data.constData(), data.size(), &len) || len != size)
+            return QImage();
+
+        if (!snappy::RawUncompress(data.constData(), data.size(), reinterpret_cast<char*>(img.bits())))
+            return QImage();
+        break;
     }
-    else
+#endif
+
+    case 0:
     {
-        rect.moveLeft(pageRect.left() * scale);
-        rect.moveTop(pageRect.top()  * scale);
+        QByteArray bits = qUncompress(data);
+        if (size_t(bits.size()) != size)
+            return QImage();
+
+        memcpy(img.bits(), bits.constData(), size);
+        break;
     }
 
-    img = img.copy(rect);
+    default:
+        return QImage();
+    }
 
-    emit pageReady(img, pageNum);
-    mBusy = false;
+    // The modification time is used for the LRU order.
+    QFile::setFileTime(file.fileName(), QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
     return img;
 }
 
@@ -165,25 +281,83 @@ QImage RenderWorker::renderPage(int sheetNum, const QRectF &pageRect, int pageNu
 /************************************************
  *
  ************************************************/
-Render::Render(double resolution, int threadCount, QObject *parent):
-    QObject(parent),
-    mResolution(resolution),
-    mThreadCount(threadCount)
+void PageRasterCache::insertDisk(const QByteArray &key, const QImage &image)
 {
-    mWorkers.reserve(threadCount);
+    if (mDiskBudget <= 0 || image.isNull())
+        return;
+
+    const char *bits = reinterpret_cast<const char*>(image.constBits());
+    const size_t size = size_t(image.bytesPerLine()) * image.height();
+
+    QByteArray data;
+    quint32 compression = 0;
+#ifdef HAVE_SNAPPY
+    data.resize(snappy::MaxCompressedLength(size));
+    size_t len = 0;
+    snappy::RawCompress(bits, size, data.data(), &len);
+    data.resize(len);
+    compression = 1;
+#else
+    data = qCompress(reinterpret_cast<const uchar*>(bits), size, 1);
+#endif
+
+    QMutexLocker locker(&mDiskMutex);
+    if (!QDir().mkpath(mDiskDir))
+        return;
+
+    // Other boomaga instances can read the same file,
+    // so it appears under its name when complete.
+    QString fileName = diskFileName(key);
+    QFile file(fileName + "." + appUUID());
+    if (!file.open(QFile::WriteOnly | QFile::Truncate))
+        return;
+
+    QDataStream stream(&file);
+    stream << RASTER_FILE_MAGIC
+           << quint32(image.width())
+           << quint32(image.height())
+           << quint32(image.bytesPerLine())
+           << quint32(image.format())
+           << compression
+           << data;
+    file.close();
+
+    QFile::remove(fileName);
+    if (stream.status() != QDataStream::Ok || !file.rename(fileName))
+    {
+        file.remove();
+        return;
+    }
+
+    if (mDiskSize > -1)
+        mDiskSize += file.size();
+
+    if (mDiskSize < 0 || mDiskSize > mDiskBudget)
+        trimDisk();
 }
 
 
 /************************************************
- *
+ * Removes the least recently used files.
  ************************************************/
-Render::~Render()
+void PageRasterCache::trimDisk()
 {
-    foreach (RenderWorker *worker, mWorkers)
+    QDir dir(mDiskDir);
+    QFileInfoList files = dir.entryInfoList(QStringList() << "*.raster",
+                                            QDir::Files,
+                                            QDir::Time | QDir::Reversed);
+
+    mDiskSize = 0;
+    foreach (const QFileInfo &fi, files)
+        mDiskSize += fi.size();
+
+    foreach (const QFileInfo &fi, files)
     {
-        worker->thread()->quit();
-        worker->thread()->wait();
-        delete worker;
+        if (mDiskSize <= mDiskBudget * DISK_CACHE_TRIM)
+            break;
+
+        if (dir.remove(fi.fileName()))
+            mDiskSize -= fi.size();
     }
 }
 
@@ -191,115 +365,201 @@ Render::~Render()
 /************************************************
  *
  ************************************************/
-void Render::setFileName(const QString &fileName)
+RenderSource::RenderSource():
+    mGeneration(0),
+    mRevision(0),
+    mDataGeneration(-1),
+    mDataRevision(-1),
+    mGrayscale(false)
+{
+}
+
+
+/************************************************
+ * The file is not read here, the workers do it when
+ * they need the new generation.
+ ************************************************/
+void RenderSource::setFileName(const QString &fileName)
 {
+    QMutexLocker locker(&mMutex);
     mFileName = fileName;
+    ++mGeneration;
+    mData.reset();
+}
 
-    foreach(RenderWorker *worker, mWorkers)
-    {
-        worker->thread()->quit();
-        worker->thread()->wait();
-        delete worker;
-    }
 
-    mWorkers.resize(mThreadCount);
+/************************************************
+ * The workers read the file again when they need it.
+ ************************************************/
+void RenderSource::reload()
+{
+    QMutexLocker locker(&mMutex);
+    ++mRevision;
+    mData.reset();
+}
 
-    for (int i=0; i<mWorkers.count(); ++i)
-    {
-        RenderWorker *worker = new RenderWorker(fileName, mResolution);
-        mWorkers[i] = worker;
 
-        connect(worker, SIGNAL(sheetReady(QImage,int)),
-                this, SIGNAL(sheetReady(QImage,int)));
+/************************************************
+ * The loaded data is still good for the new generation,
+ * only the images are rendered again.
+ ************************************************/
+void RenderSource::setGrayscale(bool value)
+{
+    QMutexLocker locker(&mMutex);
+    if (value == mGrayscale)
+        return;
+
+    mGrayscale = value;
+    if (mDataGeneration == mGeneration)
+        ++mDataGeneration;
 
-        connect(worker, SIGNAL(sheetReady(QImage,int)),
-                this, SLOT(workerFinished()));
+    ++mGeneration;
+}
 
-        connect(worker, SIGNAL(pageReady(QImage,int)),
-                this, SIGNAL(pageReady(QImage,int)));
 
-        connect(worker, SIGNAL(pageReady(QImage,int)),
-                this, SLOT(workerFinished()));
+/************************************************
+ *
+ ************************************************/
+bool RenderSource::grayscale() const
+{
+    QMutexLocker locker(&mMutex);
+    return mGrayscale;
+}
 
 
-        worker->moveToThread(worker->thread());
-        worker->thread()->start();
-    }
+/************************************************
+ *
+ ************************************************/
+QString RenderSource::fileName(int *generation, int *revision) const
+{
+    QMutexLocker locker(&mMutex);
+    *generation = mGeneration;
+    *revision = mRevision;
+    return mFileName;
 }
 
 
 /************************************************
  *
  ************************************************/
-void Render::renderSheet(int sheetNum)
+int RenderSource::generation() const
 {
-    foreach (RenderWorker *worker, mWorkers)
-    {
-        if (!worker->isBusy())
-        {
-            startRenderSheet(worker, sheetNum);
-            return;
-        }
-    }
+    QMutexLocker locker(&mMutex);
+    return mGeneration;
+}
 
-    QPair<int,bool> job(sheetNum, false);
-    if (!mQueue.contains(job))
-        mQueue.prepend(job);
+
+/************************************************
+ *
+ ************************************************/
+int RenderSource::revision() const
+{
+    QMutexLocker locker(&mMutex);
+    return mRevision;
 }
 
 
 /************************************************
  *
  ************************************************/
-void Render::renderPage(int pageNum)
+QSharedPointer<QByteArray> RenderSource::data(int generation, int revision)
 {
-    foreach (RenderWorker *worker, mWorkers)
+    // Only one worker reads the file, the others wait for it.
+    QMutexLocker loadLocker(&mLoadMutex);
+
+    QString fileName;
     {
-        if (!worker->isBusy())
-        {
-            startRenderPage(worker, pageNum);
-            return;
-        }
+        QMutexLocker locker(&mMutex);
+        if (generation != mGeneration || revision != mRevision)
+            return QSharedPointer<QByteArray>();
+
+        if (mDataGeneration == generation && mDataRevision == revision)
+            return mData;
+
+        fileName = mFileName;
     }
 
-    QPair<int,bool> job(pageNum, true);
-    if (!mQueue.contains(job))
-        mQueue.prepend(job);
+    QSharedPointer<QByteArray> res;
+    QFile file(fileName);
+    if (file.size() <= MAX_RAW_DATA_SIZE && file.open(QFile::ReadOnly))
+        res = QSharedPointer<QByteArray>(new QByteArray(file.readAll()));
 
+    QMutexLocker locker(&mMutex);
+    if (generation == mGeneration && revision == mRevision)
+    {
+        mData = res;
+        mDataGeneration = generation;
+        mDataRevision = revision;
+    }
+
+    return res;
 }
 
 
 /************************************************
  *
  ************************************************/
-void Render::cancelSheet(int sheetNum)
+PageRasterCache::PageRasterCache():
+    mImages(RASTER_CACHE_SIZE),
+    mDiskDir(QDir(boomagaChacheDir()).filePath("boomaga-render")),
+    mDiskBudget(settings->value(Settings::Render_DiskCacheSize).toLongLong() * 1024 * 1024),
+    mDiskSize(-1)
 {
-    mQueue.removeAll(QPair<int,bool>(sheetNum, false));
 }
 
 
 /************************************************
  *
  ************************************************/
-void Render::cancelPage(int pageNum)
+QImage PageRasterCache::image(const QString &key) const
+{
+    QMutexLocker locker(&mMutex);
+    QImage *img = mImages.object(key);
+    return img ? *img : QImage();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void PageRasterCache::insert(const QString &key, const QImage &image)
 {
-    mQueue.removeAll(QPair<int,bool>(pageNum, true));
+    QMutexLocker locker(&mMutex);
+    mImages.insert(key, new QImage(image), qMax(1, image.byteCount() / 1024));
+}
+
+
+/************************************************
+ * The other workers wait for the hash being computed
+ * instead of computing it again.
+ ************************************************/
+QByteArray PageRasterCache::documentHash(const QString &docKey, const QSharedPointer<PDF::Reader> &reader)
+{
+    QMutexLocker locker(&mHashMutex);
+    QHash<QString, QByteArray>::const_iterator it = mHashes.constFind(docKey);
+    if (it != mHashes.constEnd())
+        return it.value();
+
+    QByteArray res = QCryptographicHash::hash(QByteArray::fromRawData(reader->data(), reader->size()),
+                                              QCryptographicHash::Sha1);
+    mHashes.insert(docKey, res);
+    return res;
 }
 
 
 /************************************************
  *
  ************************************************/
-void Render::workerFinished()
+QSharedPointer<PDF::Reader> PageRasterCache::reader(const QString &fileName, qint64 startPos, qint64 endPos)
 {
-    if (!mQueue.isEmpty())
+    try
     {
-        RenderWorker *worker = qobject_cast<RenderWorker*>(sender());
-        QPair<int,bool> job = mQueue.takeFirst();
-        if (!job.second)
-            startRenderSheet(worker, job.first);
-        else
-            startRenderPage(worker, job.first);
+        return PDF::Reader::shared(fileName, startPos, endPos);
+    }
+    catch (PDF::Error &err)
+    {
+        qWarning() << "Can't read" << fileName << err.what();
+        return QSharedPointer<PDF::Reader>();
     }
 }
 
@@ -307,67 +567,1631 @@ void Render::workerFinished()
 /************************************************
  *
  ************************************************/
-void Render::startRenderSheet(RenderWorker *worker, int sheetNum)
+RenderWorker::RenderWorker(RenderSource *source, PageRasterCache *rasterCache):
+    QObject(),
+    mSource(source),
+    mRasterCache(rasterCache),
+    mGeneration(-1),
+    mRevision(-1),
+    mPopplerDoc(0),
+    mMemoryUsage(0)
 {
-    QMetaObject::invokeMethod(worker,
-                              "renderSheet",
-                              Qt::QueuedConnection,
-                              Q_ARG(int, sheetNum));
 }
 
 
 /************************************************
  *
  ************************************************/
-void Render::startRenderPage(RenderWorker *worker, int pageNum)
+RenderWorker::~RenderWorker()
 {
-    int sheetNum = project->previewSheets().indexOfPage(pageNum);
-    if (sheetNum < 0)
-        return;
+    clearJobDocs();
+    delete mPopplerDoc;
+}
 
-    Sheet *sheet = project->previewSheets().at(sheetNum);
-    ProjectPage *page = project->page(pageNum);
 
-    int pageOnSheet = -1;
-    for (int i = 0; i<sheet->count(); ++i)
+/************************************************
+ * Reloads the document if the file was changed
+ * since the last render.
+ ************************************************/
+bool RenderWorker::loadDocument()
+{
+    int generation;
+    int revision;
+    QString fileName = mSource->fileName(&generation, &revision);
+    if (generation == mGeneration && revision == mRevision)
+        return mPopplerDoc != 0;
+
+    delete mPopplerDoc;
+    mPopplerDoc = 0;
+    mData = mSource->data(generation, revision);
+    mGeneration = generation;
+    mRevision = revision;
+
+    if (mData)
+    {
+        mPopplerDoc = poppler::document::load_from_raw_data(mData->constData(), mData->size());
+    }
+    else if (QFileInfo(fileName).exists())
     {
-        if (sheet->page(i) == page)
-            pageOnSheet = i;
+        mPopplerDoc = poppler::document::load_from_file(fileName.toLocal8Bit().data());
     }
 
-    if (pageOnSheet < 0)
-        return;
+    updateMemoryUsage();
+    return mPopplerDoc != 0;
+}
 
-    TransformSpec spec = project->layout()->transformSpec(sheet, pageOnSheet, project->rotation());
 
-    QMetaObject::invokeMethod(worker,
-                              "renderPage",
-                              Qt::QueuedConnection,
-                              Q_ARG(int, sheetNum),
-                              Q_ARG(QRectF, spec.rect),
-                              Q_ARG(int, pageNum));
+/************************************************
+ * The color mode is read after the generation of the
+ * image is known, so if it was changed meanwhile, the
+ * image is outdated anyway.
+ ************************************************/
+void RenderWorker::applyColorMode(QImage *image)
+{
+    if (!image->isNull() && mSource->grayscale())
+        toGrayscale(image);
+}
+
+
+/************************************************
+ * The temp file data is shared by all workers and the job
+ * files are memory mapped, so the sum over the workers is
+ * the upper bound of the real usage.
+ ************************************************/
+void RenderWorker::updateMemoryUsage()
+{
+    qint64 res = 0;
+
+    // The big files are read by poppler from the disk.
+    if (mData)
+        res += mData->size();
+
+    foreach (const JobDocument &doc, mJobDocs)
+    {
+        if (doc.reader)
+            res += doc.reader->size();
+    }
+
+    mMemoryUsage.store(res);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+QImage RenderWorker::renderSheet(int sheetNum, double resolution)
+{
+    QImage img;
+    if (loadDocument())
+        img = doRenderSheet(mPopplerDoc, sheetNum, resolution);
+
+    applyColorMode(&img);
+    emit sheetReady(img, sheetNum, mGeneration);
+    return img;
+}
+
+
+/************************************************
+ * Low resolution and no antialiasing, the draft is
+ * shown while the sheet is rendered.
+ ************************************************/
+QImage RenderWorker::renderDraft(int sheetNum, const SheetComposition &composition, double resolution)
+{
+    QImage img;
+    if (composition.generation > -1)
+    {
+        img = compose(composition, resolution, false);
+        if (!img.isNull())
+        {
+            applyColorMode(&img);
+            emit draftReady(img, sheetNum, composition.generation);
+            return img;
+        }
+    }
+
+    if (loadDocument())
+        img = doRenderSheet(mPopplerDoc, sheetNum, resolution, QRect(), false);
+
+    applyColorMode(&img);
+    emit draftReady(img, sheetNum, mGeneration);
+    return img;
 }
 
 
 /************************************************
+ * Only the page region of the sheet is rendered
+ * from the temp file.
+ ************************************************/
+QImage RenderWorker::renderPage(int sheetNum, const QRect &rect, double resolution, int pageNum)
+{
+    QImage img;
+    if (loadDocument() && !rect.isEmpty())
+        img = doRenderSheet(mPopplerDoc, sheetNum, resolution, rect);
+
+    applyColorMode(&img);
+    emit pageReady(img, pageNum, mGeneration);
+    return img;
+}
 
+
+/************************************************
+ * The composition holds only the page, so only the
+ * page is rasterized, at the size of the thumbnail.
  ************************************************/
-QImage toGrayscale(const QImage &srcImage)
+QImage RenderWorker::composePage(int sheetNum, const SheetComposition &composition, double resolution, const QRect &rect, int pageNum)
 {
-    // Convert to 32bit pixel format
-    QImage dstImage = srcImage.convertToFormat(srcImage.hasAlphaChannel() ?
-                                                   QImage::Format_ARGB32 : QImage::Format_RGB32);
+    QImage img;
+    if (!rect.isEmpty())
+        img = compose(composition, resolution, true, rect);
 
-    unsigned int *data = (unsigned int*)dstImage.bits();
-    int pixelCount = dstImage.width() * dstImage.height();
+    // Let poppler draw the page from the temp file.
+    if (img.isNull())
+        return renderPage(sheetNum, rect, resolution, pageNum);
 
-    // Convert each pixel to grayscale
-    for(int i = 0; i < pixelCount; ++i)
+    applyColorMode(&img);
+    emit pageReady(img, pageNum, composition.generation);
+    return img;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void RenderWorker::clearJobDocs()
+{
+    foreach (const JobDocument &doc, mJobDocs)
+        delete doc.doc;
+
+    mJobDocs.clear();
+    updateMemoryUsage();
+}
+
+
+/************************************************
+ * Renders the job page without the /Rotate, the
+ * rotation is applied when the sheet is composed.
+ * The resolution is rounded up to the raster step,
+ * so the raster doesn't depend on the layout scale.
+ ************************************************/
+QImage RenderWorker::pageRaster(const SheetComposition::Page &page, double resolution, bool antialiasing)
+{
+    resolution = rasterResolution(resolution);
+
+    const QString docKey = QString("%1:%2:%3")
+            .arg(page.fileName)
+            .arg(page.startPos)
+            .arg(page.endPos);
+
+    const QString key = QString("%1:%2:%3:%4:%5")
+            .arg(docKey)
+            .arg(page.jobPageNum)
+            .arg(page.pdfRotation)
+            .arg(resolution)
+            .arg(antialiasing);
+
+    QImage res = mRasterCache->image(key);
+    if (!res.isNull())
+        return res;
+
+    if (!mJobDocs.contains(docKey))
+    {
+        if (mJobDocs.count() >= MAX_JOB_DOCUMENTS)
+            clearJobDocs();
+
+        JobDocument doc;
+        doc.reader = mRasterCache->reader(page.fileName, page.startPos, page.endPos);
+        doc.doc = 0;
+        if (doc.reader)
+        {
+            doc.doc = poppler::document::load_from_raw_data(doc.reader->data(), doc.reader->size());
+        }
+
+        mJobDocs.insert(docKey, doc);
+        updateMemoryUsage();
+    }
+
+    const JobDocument &jobDoc = mJobDocs[docKey];
+    poppler::document *doc = jobDoc.doc;
+    if (!doc)
+        return QImage();
+
+    // The drafts are not worth the disk space.
+    QByteArray diskKey;
+    if (antialiasing && mRasterCache->hasDisk())
+    {
+        diskKey = mRasterCache->documentHash(docKey, jobDoc.reader);
+        diskKey += QString(":%1:%2:%3").arg(page.jobPageNum).arg(page.pdfRotation).arg(resolution).toLatin1();
+        diskKey = QCryptographicHash::hash(diskKey, QCryptographicHash::Sha1);
+
+        res = mRasterCache->diskImage(diskKey);
+        if (!res.isNull())
+        {
+            mRasterCache->insert(key, res);
+            return res;
+        }
+    }
+
+    poppler::page *ppage = doc->create_page(page.jobPageNum);
+    if (!ppage)
+        return QImage();
+
+    poppler::page_renderer prender;
+    prender.set_render_hint(poppler::page_renderer::antialiasing, antialiasing);
+    prender.set_render_hint(poppler::page_renderer::text_antialiasing, antialiasing);
+
+    poppler::rotation_enum rotate = poppler::rotate_0;
+    switch ((360 - page.pdfRotation % 360) % 360)
+    {
+    case 90:  rotate = poppler::rotate_90;  break;
+    case 180: rotate = poppler::rotate_180; break;
+    case 270: rotate = poppler::rotate_270; break;
+    }
+
+    poppler::image img = prender.render_page(ppage, resolution, resolution, -1, -1, -1, -1, rotate);
+    delete ppage;
+
+    if (img.format() == poppler::image::format_rgb24 ||
+        img.format() == poppler::image::format_argb32)
+    {
+        res = toQImage(img);
+        mRasterCache->insert(key, res);
+        if (!diskKey.isEmpty())
+            mRasterCache->insertDisk(diskKey, res);
+    }
+
+    return res;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+QImage RenderWorker::composeSheet(int sheetNum, const SheetComposition &composition, double resolution)
+{
+    QImage img = compose(composition, resolution, true);
+
+    // Let poppler draw the sheet from the temp file.
+    if (img.isNull())
+        return renderSheet(sheetNum, resolution);
+
+    applyColorMode(&img);
+    emit sheetReady(img, sheetNum, composition.generation);
+    return img;
+}
+
+
+/************************************************
+ * The tile is composed like the whole sheet, or rendered
+ * from the temp file if the sheet can't be composed.
+ ************************************************/
+QImage RenderWorker::renderTile(int sheetNum, const SheetComposition &composition, double resolution, const QRect &rect, int tile)
+{
+    QImage img;
+    if (composition.generation > -1)
+    {
+        img = compose(composition, resolution, true, rect);
+        if (!img.isNull())
+        {
+            applyColorMode(&img);
+            emit tileReady(img, sheetNum, tile, composition.generation);
+            return img;
+        }
+    }
+
+    if (loadDocument())
+        img = doRenderSheet(mPopplerDoc, sheetNum, resolution, rect);
+
+    applyColorMode(&img);
+    emit tileReady(img, sheetNum, tile, mGeneration);
+    return img;
+}
+
+
+/************************************************
+ * Draws the sheet from the job page images, only the
+ * pages that were never rendered are passed to poppler.
+ * If the rect is not null, only this part of the sheet
+ * image is drawn. Returns a null image if some page
+ * can't be rendered.
+ ************************************************/
+QImage RenderWorker::compose(const SheetComposition &composition, double resolution, bool antialiasing, const QRect &rect)
+{
+    const double scale = resolution / 72.0;
+    const QRectF &paper = composition.paperRect;
+    const double w = paper.width()  * scale;
+    const double h = paper.height() * scale;
+
+    // Sheet PDF coordinates to the image pixels, like poppler
+    // renders the sheet with its /Rotate.
+    QTransform toImage = QTransform::fromTranslate(-paper.left(), -paper.top()) *
+                         QTransform(scale, 0, 0, -scale, 0, h);
+    QSize size(qRound(w), qRound(h));
+
+    switch (composition.rotation)
+    {
+    case NoRotate:
+        break;
+
+    case Rotate90:
+        toImage *= QTransform(0, 1, -1, 0, h, 0);
+        size.transpose();
+        break;
+
+    case Rotate180:
+        toImage *= QTransform(-1, 0, 0, -1, w, h);
+        break;
+
+    case Rotate270:
+        toImage *= QTransform(0, -1, 1, 0, 0, w);
+        size.transpose();
+        break;
+    }
+
+    if (!rect.isNull())
+    {
+        toImage *= QTransform::fromTranslate(-rect.left(), -rect.top());
+        size = rect.size();
+    }
+
+    QImage img(size, QImage::Format_RGB32);
+    img.fill(Qt::white);
+
+    QPainter painter(&img);
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, antialiasing);
+    painter.setRenderHint(QPainter::Antialiasing, antialiasing);
+
+    foreach (const SheetComposition::Page &page, composition.pages)
+    {
+        QTransform pageToImage = page.matrix * toImage;
+
+        if (!page.fileName.isEmpty())
+        {
+            // The page is rasterized at least at the size it has on the
+            // sheet and downscaled by the painter. The matrix scale
+            // doesn't depend on the rotation.
+            double pageResolution = resolution * qSqrt(qAbs(page.matrix.determinant()));
+            QImage raster = pageRaster(page, pageResolution, antialiasing);
+            if (raster.isNull())
+                return QImage();
+
+            // The image pixels to the page PDF coordinates.
+            QTransform rasterToPage(page.rect.width()  / raster.width(), 0,
+                                    0, -page.rect.height() / raster.height(),
+                                    page.rect.left(), page.rect.bottom());
+
+            painter.setTransform(rasterToPage * pageToImage);
+            painter.drawImage(0, 0, raster);
+        }
+
+        if (composition.drawBorder)
+        {
+            painter.setTransform(pageToImage);
+            painter.setPen(QPen(Qt::black, 0));
+            painter.setBrush(Qt::NoBrush);
+            painter.drawRect(page.rect);
+        }
+    }
+
+    painter.end();
+    return img;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+bool Render::QueueKey::operator<(const QueueKey &other) const
+{
+    if (priority != other.priority)
+        return priority < other.priority;
+
+    if (distance != other.distance)
+        return distance < other.distance;
+
+    return seq < other.seq;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+Render::Render(double resolution, int threadCount, QObject *parent):
+    QObject(parent),
+    mResolution(resolution),
+    mThreadCount(threadCount),
+    mThumbnailSize(0),
+    mSeq(0)
+{
+    if (mThreadCount < 1)
+        mThreadCount = settings->value(Settings::Render_ThreadCount).toInt();
+
+    if (mThreadCount < 1)
+        mThreadCount = QThread::idealThreadCount();
+
+    // idealThreadCount() returns -1 if the number of cores is unknown.
+    mThreadCount = qMax(1, mThreadCount);
+
+    qRegisterMetaType<SheetComposition>("SheetComposition");
+
+    mReclaimTimer.setInterval(WORKER_IDLE_TIMEOUT / 2);
+    connect(&mReclaimTimer, SIGNAL(timeout()),
+            this, SLOT(reclaimWorkers()));
+
+    connect(project, SIGNAL(currentSheetChanged(int)),
+            this, SLOT(updatePriorities()));
+
+    connect(project, SIGNAL(currentPageChanged(int)),
+            this, SLOT(updatePriorities()));
+}
+
+
+/************************************************
+ *
+ ************************************************/
+Render::~Render()
+{
+    foreach (RenderWorker *worker, mWorkers)
+        deleteWorker(worker);
+}
+
+
+/************************************************
+ * The workers are started on demand, up to the
+ * thread count, see startNext().
+ ************************************************/
+RenderWorker *Render::createWorker()
+{
+    RenderWorker *worker = new RenderWorker(&mSource, &mRasterCache);
+    mWorkers << worker;
+
+    connect(worker, SIGNAL(sheetReady(QImage,int,int)),
+            this, SLOT(workerSheetReady(QImage,int,int)));
+
+    connect(worker, SIGNAL(pageReady(QImage,int,int)),
+            this, SLOT(workerPageReady(QImage,int,int)));
+
+    connect(worker, SIGNAL(draftReady(QImage,int,int)),
+            this, SLOT(workerDraftReady(QImage,int,int)));
+
+    connect(worker, SIGNAL(tileReady(QImage,int,int,int)),
+            this, SLOT(workerTileReady(QImage,int,int,int)));
+
+    worker->moveToThread(worker->workerThread());
+    worker->workerThread()->start();
+
+    if (!mReclaimTimer.isActive())
+        mReclaimTimer.start();
+
+    return worker;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::deleteWorker(RenderWorker *worker)
+{
+    worker->workerThread()->quit();
+    worker->workerThread()->wait();
+    delete worker;
+}
+
+
+/************************************************
+ * The workers idle for WORKER_IDLE_TIMEOUT are stopped,
+ * so the loaded documents don't hold the memory.
+ ************************************************/
+void Render::reclaimWorkers()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+#ifdef DEBUG_RENDER_MEMORY
+    for (int i=0; i<mWorkers.count(); ++i)
+    {
+        qDebug() << "Render worker" << i
+                 << (mActive.contains(mWorkers.at(i)) ? "busy" : "idle")
+                 << "holds" << mWorkers.at(i)->memoryUsage() / 1024 << "KB";
+    }
+#endif
+
+    foreach (RenderWorker *worker, mIdleWorkers)
+    {
+        if (now - mIdleSince.value(worker, now) < WORKER_IDLE_TIMEOUT)
+            continue;
+
+        mIdleWorkers.removeOne(worker);
+        mIdleSince.remove(worker);
+        mWorkers.removeOne(worker);
+        deleteWorker(worker);
+    }
+
+    if (mWorkers.isEmpty())
+        mReclaimTimer.stop();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+qint64 Render::memoryUsage() const
+{
+    qint64 res = 0;
+    foreach (RenderWorker *worker, mWorkers)
+        res += worker->memoryUsage();
+
+    return res;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::setFileName(const QString &fileName)
+{
+    mFileName = fileName;
+    mSource.setFileName(fileName);
+    mSheetKeys.clear();
+
+    // The running workers reload the document
+    // lazily, see RenderWorker::loadDocument().
+    startNext();
+}
+
+
+/************************************************
+ * The pages were imported to the same file. The sheet
+ * keys and the requests for the composed images stay,
+ * see workerFinished().
+ ************************************************/
+void Render::reloadFile()
+{
+    mSource.reload();
+    startNext();
+}
+
+
+/************************************************
+ * The queued requests are rendered at the new resolution,
+ * the images for the old one are dropped when ready.
+ ************************************************/
+void Render::setResolution(double value)
+{
+    if (value == mResolution)
+        return;
+
+    mResolution = value;
+    mSheetKeys.clear();
+
+    QList<int> tiled = mTiles.keys();
+    mTiles.clear();
+    foreach (int sheetNum, tiled)
+        renderSheet(sheetNum, Visible);
+}
+
+
+/************************************************
+ * The images are converted by the workers, the
+ * color ones are dropped when ready.
+ ************************************************/
+void Render::setGrayscale(bool value)
+{
+    if (value == mSource.grayscale())
+        return;
+
+    mSource.setGrayscale(value);
+    mSheetKeys.clear();
+
+    // The tiles done in the old mode can't be mixed with the new ones.
+    QList<int> tiled = mTiles.keys();
+    mTiles.clear();
+    foreach (int sheetNum, tiled)
+        renderSheet(sheetNum, Visible);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::renderSheet(int sheetNum, Render::Priority priority)
+{
+    // The identical sheet is already rendered.
+    ImageCache *cache = ImageCache::instance();
+    QByteArray key = sheetKey(sheetNum);
+    int same = mSheetKeys.value(key, -1);
+    if (same > -1 && same != sheetNum && cache->contains(ImageCache::SheetImage, same, key))
+    {
+        emit sheetReady(cache->image(ImageCache::SheetImage, same, key), sheetNum, key);
+        return;
+    }
+
+    Request request;
+    request.priority = priority;
+    request.generation = mSource.generation();
+
+    // The draft is queued first, so it goes to the
+    // first free worker.
+    if (priority == Visible && mResolution > DRAFT_RESOLUTION * 2)
+    {
+        request.id = RequestId(sheetNum, DraftRequest);
+        enqueue(request);
+    }
+
+    request.id = RequestId(sheetNum, SheetRequest);
+    enqueue(request);
+    startNext();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::renderPage(int pageNum, Render::Priority priority)
+{
+    Request request;
+    request.id = RequestId(pageNum, PageRequest);
+    request.priority = priority;
+    request.generation = mSource.generation();
+    enqueue(request);
+    startNext();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::cancelSheet(int sheetNum)
+{
+    dequeue(RequestId(sheetNum, SheetRequest));
+    dequeue(RequestId(sheetNum, DraftRequest));
+
+    QHash<int, TiledSheet>::iterator it = mTiles.find(sheetNum);
+    if (it != mTiles.end())
+    {
+        for (int i=0; i<it.value().rects.count(); ++i)
+            dequeue(RequestId(sheetNum, TileRequest, i));
+
+        mTiles.erase(it);
+    }
+
+    QMultiHash<QByteArray, Request>::iterator dup = mDuplicates.begin();
+    while (dup != mDuplicates.end())
+    {
+        if (dup.value().id.num == sheetNum)
+            dup = mDuplicates.erase(dup);
+        else
+            ++dup;
+    }
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::cancelPage(int pageNum)
+{
+    dequeue(RequestId(pageNum, PageRequest));
+}
+
+
+/************************************************
+ * The closer to the current sheet, the sooner
+ * the image is rendered.
+ ************************************************/
+Render::QueueKey Render::queueKey(const Request &request)
+{
+    int current = request.id.kind == PageRequest ? project->currentPageNum() : project->currentSheetNum();
+
+    QueueKey key;
+    key.priority = request.priority;
+    key.distance = current < 0 ? request.id.num : qAbs(request.id.num - current);
+    key.seq = mSeq++;
+    return key;
+}
+
+
+/************************************************
+ * A repeated request replaces the queued one,
+ * the caller knows better what is visible now.
+ ************************************************/
+void Render::enqueue(const Request &request)
+{
+    // The running tile can belong to the previous split of the sheet.
+    int generation = mSource.generation();
+    int revision = mSource.revision();
+    QHash<RenderWorker*, Request>::const_iterator it;
+    for (it = mActive.constBegin(); it != mActive.constEnd() && request.id.kind != TileRequest; ++it)
+    {
+        const Request &active = it.value();
+        if (active.id == request.id && active.generation == generation &&
+            (!active.key.isEmpty() || active.revision == revision))
+            return;
+    }
+
+    dequeue(request.id);
+
+    QueueKey key = queueKey(request);
+    mQueue.insert(key, request);
+    mQueueIndex.insert(request.id, key);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::dequeue(const RequestId &id)
+{
+    QHash<RequestId, QueueKey>::iterator it = mQueueIndex.find(id);
+    if (it == mQueueIndex.end())
+        return;
+
+    mQueue.remove(it.value());
+    mQueueIndex.erase(it);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::updatePriorities()
+{
+    QList<Request> requests = mQueue.values();
+    mQueue.clear();
+    mQueueIndex.clear();
+
+    foreach (const Request &request, requests)
+    {
+        QueueKey key = queueKey(request);
+        mQueue.insert(key, request);
+        mQueueIndex.insert(request.id, key);
+    }
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::startNext()
+{
+    if (mFileName.isEmpty())
+        return;
+
+    int generation = mSource.generation();
+
+    while (!mQueue.isEmpty() &&
+           (!mIdleWorkers.isEmpty() || mWorkers.count() < mThreadCount))
+    {
+        Request request = mQueue.begin().value();
+        mQueue.erase(mQueue.begin());
+        mQueueIndex.remove(request.id);
+
+        // The prefetch requests made for the previous
+        // layout are not interesting anymore.
+        if (request.generation != generation && request.priority == Prefetch)
+            continue;
+
+        request.resolution = mResolution;
+
+        if (request.id.kind == SheetRequest)
+        {
+            request.key = sheetKey(request.id.num);
+            if (joinDuplicate(request))
+                continue;
+        }
+
+        if (request.id.kind == DraftRequest)
+            request.key = sheetKey(request.id.num);
+
+        if (request.id.kind == PageRequest)
+            request.key = pageKey(request.id.num);
+
+        if (request.id.kind == SheetRequest &&
+            request.priority == Visible &&
+            splitToTiles(request))
+            continue;
+
+        // The last idle worker is the most recently used one,
+        // the others can be reclaimed sooner.
+        RenderWorker *worker = mIdleWorkers.isEmpty() ? createWorker() : mIdleWorkers.takeLast();
+        mIdleSince.remove(worker);
+
+        switch (request.id.kind)
+        {
+        case SheetRequest:
+            startRenderSheet(worker, request.id.num);
+            break;
+
+        case DraftRequest:
+            startRenderDraft(worker, request.id.num);
+            break;
+
+        case PageRequest:
+            if (!startRenderPage(worker, request.id.num))
+            {
+                mIdleWorkers << worker;
+                mIdleSince.insert(worker, QDateTime::currentMSecsSinceEpoch());
+                continue;
+            }
+            break;
+
+        case TileRequest:
+            if (!startRenderTile(worker, request.id.num, request.id.tile))
+            {
+                mIdleWorkers << worker;
+                mIdleSince.insert(worker, QDateTime::currentMSecsSinceEpoch());
+                continue;
+            }
+            break;
+        }
+
+        request.generation = generation;
+        request.revision = mSource.revision();
+        mActive.insert(worker, request);
+    }
+}
+
+
+/************************************************
+ * The image rendered from the old file or at the old
+ * resolution is dropped, the request is repeated for
+ * the new one. Returns true if the image is up to date.
+ * The requests with a key are composed from the job
+ * files, the pages imported meanwhile don't change them.
+ ************************************************/
+bool Render::workerFinished(RenderWorker *worker, const RequestId &id, int generation)
+{
+    Request request = mActive.take(worker);
+    mIdleWorkers << worker;
+    mIdleSince.insert(worker, QDateTime::currentMSecsSinceEpoch());
+
+    bool current = generation == mSource.generation();
+    if (id.kind == SheetRequest)
+        current = current && request.resolution == mResolution;
+
+    if (request.key.isEmpty() && request.revision != mSource.revision())
+        current = false;
+
+    if (!current &&
+        request.id == id &&
+        request.priority != Prefetch &&
+        (id.kind == SheetRequest || id.kind == PageRequest))
+    {
+        request.generation = mSource.generation();
+        enqueue(request);
+    }
+
+    return current;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::workerSheetReady(const QImage &image, int sheetNum, int generation)
+{
+    RenderWorker *worker = qobject_cast<RenderWorker*>(sender());
+    QByteArray key = mActive.value(worker).key;
+    if (workerFinished(worker, RequestId(sheetNum, SheetRequest), generation))
+    {
+        // The draft is too late.
+        dequeue(RequestId(sheetNum, DraftRequest));
+
+        if (!key.isEmpty() && !image.isNull())
+            mSheetKeys.insert(key, sheetNum);
+
+        finishDuplicates(key, image);
+        emit sheetReady(image, sheetNum, key);
+    }
+    else
+    {
+        finishDuplicates(key, QImage());
+    }
+
+    startNext();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::workerDraftReady(const QImage &image, int sheetNum, int generation)
+{
+    RenderWorker *worker = qobject_cast<RenderWorker*>(sender());
+    if (workerFinished(worker, RequestId(sheetNum, DraftRequest), generation) && !image.isNull())
+        emit sheetDraftReady(image, sheetNum);
+
+    startNext();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::workerPageReady(const QImage &image, int pageNum, int generation)
+{
+    RenderWorker *worker = qobject_cast<RenderWorker*>(sender());
+    QByteArray key = mActive.value(worker).key;
+    if (workerFinished(worker, RequestId(pageNum, PageRequest), generation))
+        emit pageReady(image, pageNum, key);
+
+    startNext();
+}
+
+
+/************************************************
+ * If a tile is outdated, the whole sheet is
+ * requested again.
+ ************************************************/
+void Render::workerTileReady(const QImage &image, int sheetNum, int tile, int generation)
+{
+    RenderWorker *worker = qobject_cast<RenderWorker*>(sender());
+    Request request = mActive.value(worker);
+    bool current = workerFinished(worker, RequestId(sheetNum, TileRequest, tile), generation);
+
+    QHash<int, TiledSheet>::iterator it = mTiles.find(sheetNum);
+    if (it == mTiles.end() ||
+        it.value().resolution != request.resolution ||
+        tile >= it.value().rects.count())
+    {
+        startNext();
+        return;
+    }
+
+    TiledSheet &tiled = it.value();
+    if (!current || image.isNull())
+    {
+        Request sheet;
+        sheet.id = RequestId(sheetNum, SheetRequest);
+        sheet.priority = tiled.priority;
+        sheet.generation = mSource.generation();
+
+        for (int i=0; i<tiled.rects.count(); ++i)
+            dequeue(RequestId(sheetNum, TileRequest, i));
+
+        mTiles.erase(it);
+        enqueue(sheet);
+        startNext();
+        return;
+    }
+
+    if (!tiled.done[tile])
+    {
+        QPainter painter(&tiled.image);
+        painter.drawImage(tiled.rects[tile].topLeft(), image);
+        tiled.done[tile] = true;
+        tiled.remaining--;
+    }
+
+    if (tiled.remaining == 0)
+    {
+        QImage img = tiled.image;
+        QByteArray key = tiled.key;
+        mTiles.erase(it);
+
+        dequeue(RequestId(sheetNum, DraftRequest));
+        if (!key.isEmpty())
+            mSheetKeys.insert(key, sheetNum);
+
+        emit sheetReady(img, sheetNum, key);
+    }
+
+    startNext();
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::startRenderDraft(RenderWorker *worker, int sheetNum)
+{
+    SheetComposition composition;
+    if (!getComposition(sheetNum, &composition))
+        composition.generation = -1;
+
+    QMetaObject::invokeMethod(worker,
+                              "renderDraft",
+                              Qt::QueuedConnection,
+                              Q_ARG(int, sheetNum),
+                              Q_ARG(SheetComposition, composition),
+                              Q_ARG(double, DRAFT_RESOLUTION));
+}
+
+
+/************************************************
+ * The size of the sheet image, the sheet /Rotate
+ * is taken into account.
+ ************************************************/
+QSize Render::sheetSize(int sheetNum, double resolution) const
+{
+    const SheetList &sheets = project->previewSheets();
+    if (sheetNum < 0 || sheetNum >= sheets.count())
+        return QSize();
+
+    QSizeF size = project->printer()->paperRect().size() * (resolution / 72.0);
+    if (isLandscape(sheets.at(sheetNum)->rotation()))
+        size.transpose();
+
+    return QSize(qRound(size.width()), qRound(size.height()));
+}
+
+
+/************************************************
+ * Queues the tiles of the big sheet instead of the
+ * whole sheet. Returns false if the sheet is small.
+ ************************************************/
+bool Render::splitToTiles(const Request &request)
+{
+    const int sheetNum = request.id.num;
+    QSize size = sheetSize(sheetNum, request.resolution);
+    if (size.isEmpty() || size.width() * size.height() <= MIN_TILED_AREA)
+        return false;
+
+    TiledSheet tiled;
+    tiled.image = QImage(size, QImage::Format_RGB32);
+    tiled.image.fill(Qt::white);
+    tiled.resolution = request.resolution;
+    tiled.priority = request.priority;
+    tiled.key = request.key;
+
+    for (int y=0; y<size.height(); y+=TILE_SIZE)
+    {
+        for (int x=0; x<size.width(); x+=TILE_SIZE)
+        {
+            tiled.rects << QRect(x, y,
+                                 qMin(TILE_SIZE, size.width()  - x),
+                                 qMin(TILE_SIZE, size.height() - y));
+        }
+    }
+
+    tiled.done.fill(false, tiled.rects.count());
+    tiled.remaining = tiled.rects.count();
+    mTiles.insert(sheetNum, tiled);
+
+    for (int i=0; i<tiled.rects.count(); ++i)
+    {
+        Request tile = request;
+        tile.id = RequestId(sheetNum, TileRequest, i);
+        enqueue(tile);
+    }
+
+    return true;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+bool Render::startRenderTile(RenderWorker *worker, int sheetNum, int tile)
+{
+    QHash<int, TiledSheet>::const_iterator it = mTiles.constFind(sheetNum);
+    if (it == mTiles.constEnd() || tile >= it.value().rects.count())
+        return false;
+
+    SheetComposition composition;
+    if (!getComposition(sheetNum, &composition))
+        composition.generation = -1;
+
+    QMetaObject::invokeMethod(worker,
+                              "renderTile",
+                              Qt::QueuedConnection,
+                              Q_ARG(int, sheetNum),
+                              Q_ARG(SheetComposition, composition),
+                              Q_ARG(double, it.value().resolution),
+                              Q_ARG(QRect, it.value().rects.at(tile)),
+                              Q_ARG(int, tile));
+    return true;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void Render::startRenderSheet(RenderWorker *worker, int sheetNum)
+{
+    SheetComposition composition;
+    if (getComposition(sheetNum, &composition))
+    {
+        QMetaObject::invokeMethod(worker,
+                                  "composeSheet",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, sheetNum),
+                                  Q_ARG(SheetComposition, composition),
+                                  Q_ARG(double, mResolution));
+        return;
+    }
+
+    QMetaObject::invokeMethod(worker,
+                              "renderSheet",
+                              Qt::QueuedConnection,
+                              Q_ARG(int, sheetNum),
+                              Q_ARG(double, mResolution));
+}
+
+
+/************************************************
+ * The sheets of the preview are composed from the job
+ * pages, so a layout change doesn't wait for the temp
+ * file. Returns false if the sheet can't be composed.
+ ************************************************/
+bool Render::getComposition(int sheetNum, SheetComposition *composition) const
+{
+    const SheetList &sheets = project->previewSheets();
+    if (sheetNum < 0 || sheetNum >= sheets.count() || !project->layout())
+        return false;
+
+    const Sheet *sheet = sheets.at(sheetNum);
+    Printer *printer = project->printer();
+
+    composition->generation = mSource.generation();
+    composition->paperRect  = printer->paperRect();
+    composition->rotation   = sheet->rotation();
+    composition->drawBorder = printer->drawBorder();
+    composition->pages.reserve(sheet->count());
+
+    for (int i=0; i<sheet->count(); ++i)
+    {
+        const ProjectPage *page = sheet->page(i);
+        if (!page)
+            continue;
+
+        SheetComposition::Page p;
+        p.startPos    = 0;
+        p.endPos      = 0;
+        p.jobPageNum  = page->jobPageNum();
+        p.pdfRotation = page->pdfRotation();
+        p.rect        = page->rect();
+
+        TransformSpec spec = project->layout()->transformSpec(sheet, i, project->rotation());
+        p.matrix = spec.pageMatrix(p.rect, composition->paperRect);
+
+        if (!page->isBlankPage())
+        {
+            const Job *job = project->jobOfPage(page);
+            if (!job)
+                return false;
+
+            p.fileName = job->fileName();
+            p.startPos = job->fileStartPos();
+            p.endPos   = job->fileEndPos();
+        }
+
+        composition->pages << p;
+    }
+
+    return true;
+}
+
+
+/************************************************
+ * The sheet composition with the only page.
+ ************************************************/
+bool Render::getPageComposition(const ProjectPage *page, SheetComposition *composition) const
+{
+    const Sheet *sheet = page->sheet();
+    if (!sheet || !getComposition(sheet->sheetNum(), composition))
+        return false;
+
+    // The composition has no entries for the empty places.
+    int n = 0;
+    for (int i=0; i<sheet->count() && sheet->page(i) != page; ++i)
+    {
+        if (sheet->page(i))
+            ++n;
+    }
+
+    if (n >= composition->pages.count())
+        return false;
+
+    SheetComposition::Page p = composition->pages.at(n);
+    composition->pages.clear();
+    composition->pages << p;
+    return true;
+}
+
+
+/************************************************
+ * Returns an empty key if the sheet can't be composed.
+ ************************************************/
+QByteArray Render::sheetKey(int sheetNum) const
+{
+    SheetComposition composition;
+    if (!getComposition(sheetNum, &composition))
+        return QByteArray();
+
+    return composition.key();
+}
+
+
+/************************************************
+ * Returns an empty key if the page can't be composed.
+ ************************************************/
+QByteArray Render::pageKey(int pageNum) const
+{
+    if (pageNum < 0 || pageNum >= project->pageCount())
+        return QByteArray();
+
+    SheetComposition composition;
+    if (!getPageComposition(project->page(pageNum), &composition))
+        return QByteArray();
+
+    return composition.key();
+}
+
+
+/************************************************
+ * The request waits for the running render of the
+ * identical sheet. Returns false if there is none.
+ ************************************************/
+bool Render::joinDuplicate(const Request &request)
+{
+    if (request.key.isEmpty())
+        return false;
+
+    foreach (const Request &active, mActive)
+    {
+        if (active.id.kind == SheetRequest &&
+            active.key == request.key &&
+            active.resolution == request.resolution &&
+            active.generation == mSource.generation())
+        {
+            foreach (const Request &waiting, mDuplicates.values(request.key))
+            {
+                if (waiting.id == request.id)
+                    return true;
+            }
+
+            mDuplicates.insert(request.key, request);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/************************************************
+ * The null image means the render failed or is outdated,
+ * the waiting requests are queued again on their own.
+ ************************************************/
+void Render::finishDuplicates(const QByteArray &key, const QImage &image)
+{
+    if (key.isEmpty() || !mDuplicates.contains(key))
+        return;
+
+    QList<Request> requests = mDuplicates.values(key);
+    mDuplicates.remove(key);
+
+    foreach (Request request, requests)
+    {
+        if (image.isNull())
+        {
+            request.generation = mSource.generation();
+            enqueue(request);
+        }
+        else
+        {
+            dequeue(RequestId(request.id.num, DraftRequest));
+            emit sheetReady(image, request.id.num, key);
+        }
+    }
+}
+
+
+/************************************************
+ *
+ ************************************************/
+bool Render::startRenderPage(RenderWorker *worker, int pageNum)
+{
+    if (pageNum < 0 || pageNum >= project->pageCount())
+        return false;
+
+    ProjectPage *page = project->page(pageNum);
+    Sheet *sheet = page->sheet();
+    if (!sheet)
+        return false;
+
+    int sheetNum = sheet->sheetNum();
+    int pageOnSheet = sheet->indexOfPage(page);
+    if (pageOnSheet < 0)
+        return false;
+
+    TransformSpec spec = project->layout()->transformSpec(sheet, pageOnSheet, project->rotation());
+
+    // The thumbnails are rendered just big enough for the icon.
+    double resolution = mResolution;
+    if (mThumbnailSize > 0)
+    {
+        double pageSize = qMax(spec.rect.width(), spec.rect.height());
+        if (pageSize > 0)
+            resolution = mThumbnailSize * 72.0 / pageSize;
+    }
+
+    QRect rect = pageImageRect(spec.rect, resolution);
+
+    SheetComposition composition;
+    if (getPageComposition(page, &composition))
+    {
+        QMetaObject::invokeMethod(worker,
+                                  "composePage",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(int, sheetNum),
+                                  Q_ARG(SheetComposition, composition),
+                                  Q_ARG(double, resolution),
+                                  Q_ARG(QRect, rect),
+                                  Q_ARG(int, pageNum));
+        return true;
+    }
+
+    QMetaObject::invokeMethod(worker,
+                              "renderPage",
+                              Qt::QueuedConnection,
+                              Q_ARG(int, sheetNum),
+                              Q_ARG(QRect, rect),
+                              Q_ARG(double, resolution),
+                              Q_ARG(int, pageNum));
+    return true;
+}
+
+
+/************************************************
+ * The page box of the sheet in the pixels of the
+ * sheet image, the image is rotated like the sheet.
+ ************************************************/
+QRect Render::pageImageRect(const QRectF &pageRect, double resolution) const
+{
+    QSizeF printerSize = project->printer()->paperRect().size();
+
+    if (isLandscape(project->rotation()))
+        printerSize.transpose();
+
+    double scale = resolution / 72.0;
+
+    QSize size = QSize(pageRect.width()  * scale,
+                       pageRect.height() * scale);
+
+    if (isLandscape(project->rotation()))
+        size.transpose();
+
+    QRect rect(QPoint(0, 0), size);
+    if (isLandscape(project->rotation()))
+    {
+        rect.moveRight(printerSize.width() * scale - pageRect.top()  * scale);
+        rect.moveTop(pageRect.left() * scale);
+    }
+    else
+    {
+        rect.moveLeft(pageRect.left() * scale);
+        rect.moveTop(pageRect.top()  * scale);
+    }
+
+    return rect;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+ImageCache::ImageCache()
+{
+    mInserted[SheetImage] = 0;
+    mInserted[PageImage]  = 0;
+    mInsertedCount[SheetImage] = 0;
+    mInsertedCount[PageImage]  = 0;
+
+    setBudget(settings->value(Settings::Render_CacheSize).toLongLong() * 1024 * 1024);
+
+    connect(project, SIGNAL(sheetsReplaced(int,int,int)),
+            this, SLOT(replaceSheets(int,int,int)));
+
+    connect(project, SIGNAL(pagesReplaced(int,int,int)),
+            this, SLOT(replacePages(int,int,int)));
+}
+
+
+/************************************************
+ *
+ ************************************************/
+ImageCache *ImageCache::instance()
+{
+    static ImageCache inst;
+    return &inst;
+}
+
+
+/************************************************
+ * The cost of the items is in kilobytes.
+ ************************************************/
+void ImageCache::setBudget(qint64 bytes)
+{
+    mItems.setMaxCost(qMax(qint64(1), bytes / 1024));
+}
+
+
+/************************************************
+ *
+ ************************************************/
+QImage ImageCache::image(Kind kind, int num, const QByteArray &key) const
+{
+    const Item *res = item(kind, num, key);
+    return res ? res->image : QImage();
+}
+
+
+/************************************************
+ * The image of the other content is stale, the project
+ * didn't report the sheet or the page as replaced.
+ ************************************************/
+const ImageCache::Item *ImageCache::item(Kind kind, int num, const QByteArray &key) const
+{
+    Item *res = mItems.object(Key(kind, num));
+    if (res && !key.isEmpty() && !res->key.isEmpty() && res->key != key)
+    {
+        mItems.remove(Key(kind, num));
+        return 0;
+    }
+
+    return res;
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void ImageCache::insert(Kind kind, int num, const QImage &image, const QByteArray &key)
+{
+    if (image.isNull())
+        return;
+
+    Item *entry = new Item;
+    entry->image = image;
+    entry->key = key;
+
+    int cost = qMax(1, image.byteCount() / 1024);
+    mItems.insert(Key(kind, num), entry, cost);
+
+    mInserted[kind] += image.byteCount();
+    mInsertedCount[kind]++;
+
+    // Recent images are more representative.
+    if (mInsertedCount[kind] > 64)
+    {
+        mInserted[kind] /= 2;
+        mInsertedCount[kind] /= 2;
+    }
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void ImageCache::clear(Kind kind)
+{
+    foreach (const Key &key, mItems.keys())
+    {
+        if (key.first == kind)
+            mItems.remove(key);
+    }
+}
+
+
+/************************************************
+ * The moved images are inserted again, the statistics
+ * of the inserted images are not affected.
+ ************************************************/
+void ImageCache::replace(Kind kind, int first, int oldCount, int newCount)
+{
+    const int end = first + oldCount;
+    const int delta = newCount - oldCount;
+
+    QList<QPair<int, Item*> > moved;
+    foreach (const Key &key, mItems.keys())
+    {
+        if (key.first != kind || key.second < first)
+            continue;
+
+        if (key.second < end)
+            mItems.remove(key);
+        else if (delta)
+            moved << qMakePair(key.second + delta, mItems.take(key));
+    }
+
+    for (int i=0; i<moved.count(); ++i)
+    {
+        Item *entry = moved.at(i).second;
+        mItems.insert(Key(kind, moved.at(i).first), entry, qMax(1, entry->image.byteCount() / 1024));
+    }
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void ImageCache::replaceSheets(int first, int oldCount, int newCount)
+{
+    replace(SheetImage, first, oldCount, newCount);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+void ImageCache::replacePages(int first, int oldCount, int newCount)
+{
+    replace(PageImage, first, oldCount, newCount);
+}
+
+
+/************************************************
+ *
+ ************************************************/
+qint64 ImageCache::averageSize(Kind kind) const
+{
+    if (!mInsertedCount[kind])
+        return 0;
+
+    return mInserted[kind] / mInsertedCount[kind];
+}
+
+
+/************************************************
+ * qGray() for the 32 bit pixels, the alpha is kept.
+ ************************************************/
+static void grayscaleLine(quint32 *data, int count)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    const __m128i mask  = _mm_set1_epi32(0xFF);
+    const __m128i alpha = _mm_set1_epi32(0xFF000000);
+    const __m128i kRed  = _mm_set1_epi32(11);
+    const __m128i kBlue = _mm_set1_epi32(5);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(px, 16), mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(px, 8),  mask);
+        __m128i b = _mm_and_si128(px, mask);
+
+        // (r * 11 + g * 16 + b * 5) / 32, the products fit
+        // into the low 16 bits of each 32 bit lane.
+        __m128i gray = _mm_add_epi32(_mm_mullo_epi16(r, kRed), _mm_slli_epi32(g, 4));
+        gray = _mm_add_epi32(gray, _mm_mullo_epi16(b, kBlue));
+        gray = _mm_srli_epi32(gray, 5);
+
+        __m128i res = _mm_or_si128(gray, _mm_slli_epi32(gray, 8));
+        res = _mm_or_si128(res, _mm_slli_epi32(gray, 16));
+        res = _mm_or_si128(res, _mm_and_si128(px, alpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), res);
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        int val = qGray(data[i]);
+        data[i] = qRgba(val, val, val, qAlpha(data[i]));
+    }
+}
+
+
+/************************************************
+ * Converts the image in place, the image
+ * is not copied if it is not shared.
+ ************************************************/
+void toGrayscale(QImage *image)
+{
+    switch (image->format())
     {
-        int val = qGray(*data);
-        *data = qRgba(val, val, val, qAlpha(*data));
-        ++data;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        break;
+
+    default:
+        *image = image->convertToFormat(image->hasAlphaChannel() ?
+                                            QImage::Format_ARGB32 : QImage::Format_RGB32);
     }
 
-    return dstImage;
+    uchar *bits = image->bits();
+    for (int y = 0; y < image->height(); ++y)
+        grayscaleLine(reinterpret_cast<quint32*>(bits + y * image->bytesPerLine()), image->width());
 }
@@ -32,36 +32,195 @@
 #include <QThread>
 #include <QList>
 #include <QPair>
+#include <QMutex>
+#include <QHash>
+#include <QMap>
+#include <QVector>
+#include <QCache>
+#include <QTransform>
+#include <QRectF>
+#include "boomagatypes.h"
+#include <QSharedPointer>
+#include <QTimer>
+#include <QAtomicInteger>
 
 namespace poppler
 {
     class document;
 }
 
+namespace PDF
+{
+    class Reader;
+}
+
+class ProjectPage;
+
+/************************************************
+ * Describes how the job pages are placed on the
+ * sheet, the render workers draw the sheet from the
+ * page images without the temp file.
+ ************************************************/
+struct SheetComposition
+{
+    struct Page
+    {
+        QString fileName;       // Empty for blank pages
+        qint64 startPos;
+        qint64 endPos;
+        int jobPageNum;
+        int pdfRotation;
+        QRectF rect;            // The page box in the PDF coordinates
+        QTransform matrix;      // Page to sheet PDF coordinates
+    };
+
+    int generation;
+    QRectF paperRect;
+    Rotation rotation;
+    bool drawBorder;
+    QVector<Page> pages;
+
+    // The sheets with the same key have the same image,
+    // the generation is not taken into account.
+    QByteArray key() const;
+};
+
+Q_DECLARE_METATYPE(SheetComposition)
+
+
+/************************************************
+ * The rasterized job pages shared by the workers.
+ ************************************************/
+class PageRasterCache
+{
+public:
+    PageRasterCache();
+
+    QImage image(const QString &key) const;
+    void insert(const QString &key, const QImage &image);
+
+    // The job document is parsed once for all the workers.
+    QSharedPointer<PDF::Reader> reader(const QString &fileName, qint64 startPos, qint64 endPos);
+
+    // The persistent copy of the images, survives the session.
+    // The key is the hash of the document bytes, the page number
+    // and the resolution.
+    bool hasDisk() const { return mDiskBudget > 0; }
+    QImage diskImage(const QByteArray &key);
+    void insertDisk(const QByteArray &key, const QImage &image);
+
+    // The hash of the document bytes, it is computed
+    // once for the document and shared by the workers.
+    QByteArray documentHash(const QString &docKey, const QSharedPointer<PDF::Reader> &reader);
+
+private:
+    mutable QMutex mMutex;
+    QCache<QString, QImage> mImages;
+
+    QMutex mHashMutex;
+    QHash<QString, QByteArray> mHashes;
+
+    QMutex mDiskMutex;
+    QString mDiskDir;
+    qint64 mDiskBudget;
+    qint64 mDiskSize;       // -1 until the directory is scanned
+
+    QString diskFileName(const QByteArray &key) const;
+    void trimDisk();
+};
+
+
+/************************************************
+ * The document shared by the render workers. The file
+ * is read once per generation, the workers load their
+ * poppler documents from this copy.
+ ************************************************/
+class RenderSource
+{
+public:
+    RenderSource();
+
+    void setFileName(const QString &fileName);
+
+    // The pages were appended to the same file, only the images
+    // drawn from the file are outdated, not the composed ones.
+    void reload();
+
+    QString fileName(int *generation, int *revision) const;
+    int generation() const;
+    int revision() const;
+
+    // Changing the color mode starts the new generation.
+    void setGrayscale(bool value);
+    bool grayscale() const;
+
+    // Returns an empty pointer if the generation or the revision
+    // is outdated or the file is too big to hold in memory.
+    QSharedPointer<QByteArray> data(int generation, int revision);
+
+private:
+    mutable QMutex mMutex;
+    QMutex mLoadMutex;
+    QString mFileName;
+    int mGeneration;
+    int mRevision;
+    QSharedPointer<QByteArray> mData;
+    int mDataGeneration;
+    int mDataRevision;
+    bool mGrayscale;
+};
+
+
 class RenderWorker: public QObject
 {
     Q_OBJECT
 public:
-    explicit RenderWorker(const QString &fileName, int resolution);
+    explicit RenderWorker(RenderSource *source, PageRasterCache *rasterCache);
     virtual ~RenderWorker();
 
-    bool isBusy() const { return mBusy; }
-    QThread *thread() { return &mThread; }
+    QThread *workerThread() { return &mThread; }
+
+    // The size of the documents held by the worker in bytes,
+    // the poppler internal data is not counted. Thread-safe.
+    qint64 memoryUsage() const { return mMemoryUsage.load(); }
 
 public slots:
-    QImage renderSheet(int sheetNum);
-    QImage renderPage(int sheetNum, const QRectF &pageRect, int pageNum);
+    QImage renderSheet(int sheetNum, double resolution);
+    QImage renderPage(int sheetNum, const QRect &rect, double resolution, int pageNum);
+    QImage composePage(int sheetNum, const SheetComposition &composition, double resolution, const QRect &rect, int pageNum);
+    QImage composeSheet(int sheetNum, const SheetComposition &composition, double resolution);
+    QImage renderDraft(int sheetNum, const SheetComposition &composition, double resolution);
+    QImage renderTile(int sheetNum, const SheetComposition &composition, double resolution, const QRect &rect, int tile);
 
 signals:
-    void sheetReady(QImage, int sheetNum);
-    void pageReady(QImage, int pageNum);
+    void sheetReady(QImage, int sheetNum, int generation);
+    void pageReady(QImage, int pageNum, int generation);
+    void draftReady(QImage, int sheetNum, int generation);
+    void tileReady(QImage, int sheetNum, int tile, int generation);
 
 private:
-    int mSheetNum;
-    int mResolution;
-    bool mBusy;
     QThread mThread;
+    RenderSource *mSource;
+    PageRasterCache *mRasterCache;
+    int mGeneration;
+    int mRevision;
     poppler::document *mPopplerDoc;
+    QSharedPointer<QByteArray> mData;
+
+    struct JobDocument
+    {
+        QSharedPointer<PDF::Reader> reader;
+        poppler::document *doc;
+    };
+    QHash<QString, JobDocument> mJobDocs;
+    QAtomicInteger<qint64> mMemoryUsage;
+
+    bool loadDocument();
+    void updateMemoryUsage();
+    void applyColorMode(QImage *image);
+    QImage pageRaster(const SheetComposition::Page &page, double resolution, bool antialiasing);
+    QImage compose(const SheetComposition &composition, double resolution, bool antialiasing, const QRect &rect = QRect());
+    void clearJobDocs();
 };
 
 
@@ -69,39 +228,242 @@ class Render : public QObject
 {
     Q_OBJECT
 public:
-    explicit Render(double resolution, int threadCount = 8, QObject *parent = 0);
+    enum Priority
+    {
+        Visible   = 0,  // The sheet in the main preview
+        Thumbnail = 1,  // The icons in the pages list
+        Prefetch  = 2   // The neighbours of the current sheet
+    };
+
+    // The threadCount 0 means the Render/ThreadCount setting,
+    // or the number of the CPU cores if it is not set.
+    explicit Render(double resolution, int threadCount = 0, QObject *parent = 0);
     virtual ~Render();
 
+    int threadCount() const { return mThreadCount; }
+    int workerCount() const { return mWorkers.count(); }
+
+    // The memory held by the running workers in bytes.
+    qint64 memoryUsage() const;
+
     QString fileName() const { return mFileName; }
 
+    double resolution() const { return mResolution; }
+
+    // The images are converted to grayscale by the workers.
+    bool grayscale() const { return mSource.grayscale(); }
+
+    // The pages are rendered to fit into size x size pixels,
+    // 0 means the page is rendered at the sheet resolution.
+    int thumbnailSize() const { return mThumbnailSize; }
+    void setThumbnailSize(int value) { mThumbnailSize = value; }
+
+    // The content of the sheet or the page image, see SheetComposition::key().
+    // Empty if it can't be composed.
+    QByteArray sheetKey(int sheetNum) const;
+    QByteArray pageKey(int pageNum) const;
+
 public slots:
     void setFileName(const QString &fileName);
+    void reloadFile();
+    void setResolution(double value);
+    void setGrayscale(bool value);
 
-    void renderSheet(int sheetNum);
+    void renderSheet(int sheetNum, Render::Priority priority = Visible);
     void cancelSheet(int sheetNum);
 
-    void renderPage(int pageNum);
+    void renderPage(int pageNum, Render::Priority priority = Thumbnail);
     void cancelPage(int pageNum);
 
 signals:
-    void sheetReady(QImage, int sheetNum);
-    void pageReady(QImage, int pageNum);
+    // The key is the content the image was rendered for,
+    // see sheetKey() and pageKey().
+    void sheetReady(QImage, int sheetNum, QByteArray key);
+    void pageReady(QImage, int pageNum, QByteArray key);
+
+    // The fast low quality image, it is emitted before
+    // the sheetReady() for the Visible sheets.
+    void sheetDraftReady(QImage, int sheetNum);
 
 private slots:
-    void workerFinished();
+    void workerSheetReady(const QImage &image, int sheetNum, int generation);
+    void workerDraftReady(const QImage &image, int sheetNum, int generation);
+    void workerPageReady(const QImage &image, int pageNum, int generation);
+    void workerTileReady(const QImage &image, int sheetNum, int tile, int generation);
+    void updatePriorities();
+    void reclaimWorkers();
 
 private:
+    enum RequestKind
+    {
+        SheetRequest,
+        PageRequest,
+        DraftRequest,   // The fast low resolution sheet
+        TileRequest     // A part of the big visible sheet
+    };
+
+    struct RequestId
+    {
+        RequestId(int num = -1, RequestKind kind = SheetRequest, int tile = -1):
+            num(num), kind(kind), tile(tile) {}
+
+        int num;            // Sheet or page number
+        RequestKind kind;
+        int tile;
+
+        bool operator==(const RequestId &other) const
+        {
+            return num == other.num && kind == other.kind && tile == other.tile;
+        }
+
+        friend uint qHash(const RequestId &id, uint seed = 0)
+        {
+            return qHash(id.num, seed) ^ (uint(id.kind) << 24) ^ (uint(id.tile + 1) << 16);
+        }
+    };
+
+    struct Request
+    {
+        Request(): priority(Visible), generation(-1), revision(-1), resolution(0) {}
+
+        RequestId id;
+        Priority priority;
+        int generation;
+        int revision;       // Of the temp file, see RenderSource::reload()
+        double resolution;
+        QByteArray key;     // See SheetComposition::key()
+    };
+
+    // The visible sheet is split into the tiles
+    // rendered by several workers in parallel.
+    struct TiledSheet
+    {
+        QImage image;
+        QVector<QRect> rects;
+        QVector<bool> done;
+        int remaining;
+        double resolution;
+        Priority priority;
+        QByteArray key;
+    };
+
+    struct QueueKey
+    {
+        int priority;
+        int distance;
+        quint64 seq;
+
+        bool operator<(const QueueKey &other) const;
+    };
+
     QString mFileName;
-    QVector<RenderWorker*> mWorkers;
-    int mResolution;
+    RenderSource mSource;
+    PageRasterCache mRasterCache;
+    QList<RenderWorker*> mWorkers;
+    QList<RenderWorker*> mIdleWorkers;
+    QHash<RenderWorker*, qint64> mIdleSince;
+    QTimer mReclaimTimer;
+    QHash<RenderWorker*, Request> mActive;
+    double mResolution;
     int mThreadCount;
-    QList<QPair<int, bool> > mQueue;
+    int mThumbnailSize;
+    QHash<int, TiledSheet> mTiles;
+    QMap<QueueKey, Request> mQueue;
+    QHash<RequestId, QueueKey> mQueueIndex;
+    quint64 mSeq;
+
+    // The identical sheets are rendered once. mSheetKeys holds the
+    // sheet rendered for the key, mDuplicates are the requests
+    // waiting for the running render of the same sheet.
+    QHash<QByteArray, int> mSheetKeys;
+    QMultiHash<QByteArray, Request> mDuplicates;
+
+    RenderWorker *createWorker();
+    void deleteWorker(RenderWorker *worker);
+
+    void enqueue(const Request &request);
+    void dequeue(const RequestId &id);
+    QueueKey queueKey(const Request &request);
+    void startNext();
+    bool workerFinished(RenderWorker *worker, const RequestId &id, int generation);
+
+    bool joinDuplicate(const Request &request);
+    void finishDuplicates(const QByteArray &key, const QImage &image);
+
+    QSize sheetSize(int sheetNum, double resolution) const;
+    bool splitToTiles(const Request &request);
 
     void startRenderSheet(RenderWorker *worker, int sheetNum);
-    void startRenderPage(RenderWorker *worker, int pageNum);
+    void startRenderDraft(RenderWorker *worker, int sheetNum);
+    bool startRenderTile(RenderWorker *worker, int sheetNum, int tile);
+    bool getComposition(int sheetNum, SheetComposition *composition) const;
+    bool getPageComposition(const ProjectPage *page, SheetComposition *composition) const;
+    bool startRenderPage(RenderWorker *worker, int pageNum);
+    QRect pageImageRect(const QRectF &pageRect, double resolution) const;
+
+};
+
+/************************************************
+ * The rendered sheets and thumbnails, shared by the
+ * views. The least recently used images are dropped
+ * when the cache exceeds its memory budget.
+ * The images follow the sheets and the pages replaced
+ * by the project update. The images are inserted with
+ * the key of their content, the image of the other
+ * content is not returned.
+ ************************************************/
+class ImageCache: public QObject
+{
+    Q_OBJECT
+public:
+    enum Kind
+    {
+        SheetImage,
+        PageImage
+    };
+
+    static ImageCache *instance();
+
+    qint64 budget() const { return qint64(mItems.maxCost()) * 1024; }
+    void setBudget(qint64 bytes);
+    qint64 size() const { return qint64(mItems.totalCost()) * 1024; }
 
+    // The empty key matches any image.
+    bool contains(Kind kind, int num, const QByteArray &key = QByteArray()) const { return item(kind, num, key) != 0; }
+    QImage image(Kind kind, int num, const QByteArray &key = QByteArray()) const;
+    void insert(Kind kind, int num, const QImage &image, const QByteArray &key = QByteArray());
+    void remove(Kind kind, int num) { mItems.remove(Key(kind, num)); }
+    void clear(Kind kind);
+
+    // The images from first to first + oldCount are dropped, the
+    // images after them are moved by newCount - oldCount.
+    void replace(Kind kind, int first, int oldCount, int newCount);
+
+    // The average image size of the kind in bytes.
+    qint64 averageSize(Kind kind) const;
+
+private slots:
+    void replaceSheets(int first, int oldCount, int newCount);
+    void replacePages(int first, int oldCount, int newCount);
+
+private:
+    typedef QPair<int, int> Key;
+
+    struct Item
+    {
+        QImage image;
+        QByteArray key;     // See SheetComposition::key()
+    };
+
+    ImageCache();
+    const Item *item(Kind kind, int num, const QByteArray &key) const;
+
+    mutable QCache<Key, Item> mItems;
+    qint64 mInserted[2];
+    int mInsertedCount[2];
 };
 
-QImage toGrayscale(const QImage &srcImage);
+
+void toGrayscale(QImage *image);
 
 #endif // RENDER_H
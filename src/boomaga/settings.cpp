@@ -154,6 +154,11 @@ QString Settings::keyToString(Settings::Key key) const
     // ExportPDF ****************************
     case ExportPDF_FileName:            return "ExportPDF/FileName";
 
+    // Render *******************************
+    case Render_CacheSize:              return "Render/CacheSize";
+    case Render_DiskCacheSize:          return "Render/DiskCacheSize";
+    case Render_ThreadCount:            return "Render/ThreadCount";
+
     }
 
     return "";
@@ -174,6 +179,9 @@ void Settings::init()
     setDefaultValue(SubBookletSize, 20);
     setDefaultValue(MainWindow_PageListIconSize, 64);
     setDefaultValue(MainWindow_PageListTab, 0);
+    setDefaultValue(Render_CacheSize, 256);
+    setDefaultValue(Render_DiskCacheSize, 512);
+    setDefaultValue(Render_ThreadCount, 0);     // The number of the CPU cores
 
     setDefaultValue(AllowNegativeMargins, false);
     setDefaultValue(AutoSave, false);
@@ -87,7 +87,12 @@ public:
         PrinterDialog_Geometry,
 
         // ExportPDF ****************************
-        ExportPDF_FileName
+        ExportPDF_FileName,
+
+        // Render *******************************
+        Render_CacheSize,
+        Render_DiskCacheSize,
+        Render_ThreadCount
 
     };
 
@@ -35,6 +35,10 @@
 #include <QTemporaryFile>
 #include <QUrl>
 #include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <limits>
 
 #define protected public
 #include "../kernel/layout.h"
@@ -43,6 +47,8 @@
 #include "iofiles/boofile.h"
 #include "../boomagatypes.h"
 #include "../kernel/projectpage.h"
+#include "../kernel/tmppdffile.h"
+#include "../render.h"
 #include "../settings.h"
 #include "../../common.h"
 
@@ -1100,6 +1106,569 @@ void TestBoomaga::test_BooklesSplit()
     delete layout;
 }
 
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_SheetIsSame()
+{
+    ProjectPage page1;
+    ProjectPage page2;
+
+    Sheet sheet(2, 0);
+    sheet.setPage(0, &page1);
+    sheet.setPage(1, &page2);
+
+    Sheet same(2, 1);
+    same.setPage(0, &page1);
+    same.setPage(1, &page2);
+    QVERIFY(sheet.isSame(same));
+
+    Sheet swapped(2, 0);
+    swapped.setPage(0, &page2);
+    swapped.setPage(1, &page1);
+    QVERIFY(!sheet.isSame(swapped));
+
+    same.setHint(Sheet::HintSubBooklet, true);
+    QVERIFY(!sheet.isSame(same));
+
+    // The page rotated after the sheet was filled.
+    page2.setManualRotation(Rotate90);
+    Sheet rotated(2, 0);
+    rotated.setPage(0, &page1);
+    rotated.setPage(1, &page2);
+    QVERIFY(!sheet.isSame(rotated));
+}
+
+
+/************************************************
+ * The image number is kept in the red channel.
+ ************************************************/
+static QImage numberedImage(int num)
+{
+    QImage img(1, 1, QImage::Format_RGB32);
+    img.fill(qRgb(num, 0, 0));
+    return img;
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_ImageCacheReplace()
+{
+    QFETCH(int, count);
+    QFETCH(int, first);
+    QFETCH(int, oldCount);
+    QFETCH(int, newCount);
+    QFETCH(QString, expected);
+
+    ImageCache *cache = ImageCache::instance();
+    cache->clear(ImageCache::SheetImage);
+    cache->clear(ImageCache::PageImage);
+
+    for (int i=0; i<count; ++i)
+        cache->insert(ImageCache::SheetImage, i, numberedImage(i));
+
+    // The other kind is not touched.
+    cache->insert(ImageCache::PageImage, first, numberedImage(100));
+
+    cache->replace(ImageCache::SheetImage, first, oldCount, newCount);
+
+    QStringList result;
+    for (int i=0; i<count - oldCount + newCount; ++i)
+    {
+        QImage img = cache->image(ImageCache::SheetImage, i);
+        result << (img.isNull() ? QString("-") : QString::number(qRed(img.pixel(0, 0))));
+    }
+
+    QCOMPARE(result.join(" "), expected);
+    QVERIFY(!cache->contains(ImageCache::SheetImage, count - oldCount + newCount));
+    QCOMPARE(qRed(cache->image(ImageCache::PageImage, first).pixel(0, 0)), 100);
+
+    cache->clear(ImageCache::SheetImage);
+    cache->clear(ImageCache::PageImage);
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_ImageCacheReplace_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<int>("first");
+    QTest::addColumn<int>("oldCount");
+    QTest::addColumn<int>("newCount");
+    QTest::addColumn<QString>("expected");
+
+    QTest::newRow("same count")     << 6 << 2 << 1 << 1 << "0 1 - 3 4 5";
+    QTest::newRow("inserted")       << 6 << 2 << 1 << 3 << "0 1 - - - 3 4 5";
+    QTest::newRow("removed")        << 6 << 1 << 3 << 1 << "0 - 4 5";
+    QTest::newRow("removed all")    << 6 << 0 << 6 << 0 << "";
+    QTest::newRow("appended")       << 6 << 6 << 0 << 2 << "0 1 2 3 4 5 - -";
+    QTest::newRow("first replaced") << 6 << 0 << 1 << 1 << "- 1 2 3 4 5";
+    QTest::newRow("nothing")        << 6 << 3 << 0 << 0 << "0 1 2 3 4 5";
+}
+
+
+/************************************************
+ * The image of the other content is dropped even
+ * if the sheet was not reported as replaced.
+ * ***********************************************/
+void TestBoomaga::test_ImageCacheKey()
+{
+    ImageCache *cache = ImageCache::instance();
+    cache->clear(ImageCache::SheetImage);
+
+    cache->insert(ImageCache::SheetImage, 0, numberedImage(0), "A");
+    cache->insert(ImageCache::SheetImage, 1, numberedImage(1), "B");
+    cache->insert(ImageCache::SheetImage, 2, numberedImage(2));
+
+    QVERIFY(cache->contains(ImageCache::SheetImage, 0, "A"));
+    QVERIFY(cache->contains(ImageCache::SheetImage, 0));
+
+    QVERIFY(!cache->contains(ImageCache::SheetImage, 1, "C"));
+    QVERIFY(cache->image(ImageCache::SheetImage, 1, "C").isNull());
+    QVERIFY(!cache->contains(ImageCache::SheetImage, 1, "B"));
+
+    // The content of the image without the key is unknown.
+    QVERIFY(cache->contains(ImageCache::SheetImage, 2, "C"));
+
+    // The moved image keeps its key.
+    cache->replace(ImageCache::SheetImage, 0, 0, 1);
+    QVERIFY(cache->contains(ImageCache::SheetImage, 1, "A"));
+    QVERIFY(!cache->contains(ImageCache::SheetImage, 0));
+
+    cache->clear(ImageCache::SheetImage);
+}
+
+
+/************************************************
+ * The sizes are the sides of the RGB32 images,
+ * the 16x16 image costs 1 KB.
+ * ***********************************************/
+void TestBoomaga::test_ImageCacheCost()
+{
+    QFETCH(int,     budgetKb);
+    QFETCH(QString, sizes);
+    QFETCH(QString, expectedKept);
+    QFETCH(int,     expectedKb);
+
+    ImageCache *cache = ImageCache::instance();
+    const qint64 oldBudget = cache->budget();
+    cache->clear(ImageCache::SheetImage);
+    cache->clear(ImageCache::PageImage);
+    cache->setBudget(qint64(budgetKb) * 1024);
+
+    QStringList sides = sizes.split(" ", QString::SkipEmptyParts);
+    for (int i=0; i<sides.count(); ++i)
+    {
+        QImage img(sides.at(i).toInt(), sides.at(i).toInt(), QImage::Format_RGB32);
+        img.fill(qRgb(i, 0, 0));
+        cache->insert(ImageCache::SheetImage, i, img);
+    }
+
+    QStringList kept;
+    for (int i=0; i<sides.count(); ++i)
+    {
+        if (cache->contains(ImageCache::SheetImage, i))
+            kept << QString::number(i);
+    }
+
+    QCOMPARE(kept.join(" "), expectedKept);
+    QCOMPARE(cache->size(), qint64(expectedKb) * 1024);
+
+    // The moved images cost the same.
+    cache->replace(ImageCache::SheetImage, 0, 0, 2);
+    QCOMPARE(cache->size(), qint64(expectedKb) * 1024);
+
+    cache->replace(ImageCache::SheetImage, 0, sides.count() + 2, 0);
+    QCOMPARE(cache->size(), qint64(0));
+
+    cache->setBudget(oldBudget);
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_ImageCacheCost_data()
+{
+    QTest::addColumn<int>("budgetKb");
+    QTest::addColumn<QString>("sizes");
+    QTest::addColumn<QString>("expectedKept");
+    QTest::addColumn<int>("expectedKb");
+
+    QTest::newRow("fits")           << 100 << "16 32 64"    << "0 1 2"  << 21;
+    QTest::newRow("exact")          << 21  << "16 32 64"    << "0 1 2"  << 21;
+    QTest::newRow("oldest dropped") << 20  << "16 32 64"    << "1 2"    << 20;
+    QTest::newRow("several dropped")<< 17  << "32 16 16 64" << "2 3"    << 17;
+    QTest::newRow("too big")        << 8   << "64"          << ""       << 0;
+    QTest::newRow("at least 1 KB")  << 4   << "8 8 8 8 8"   << "1 2 3 4" << 4;
+}
+
+
+/************************************************
+ * The SSE2 code converts 4 pixels at once, the
+ * rest of the line goes through the qGray() loop.
+ * Both should give the same result.
+ * ***********************************************/
+void TestBoomaga::test_ToGrayscale()
+{
+    QFETCH(int, width);
+    QFETCH(int, height);
+    QFETCH(int, format);
+
+    QImage src(width, height, QImage::Format_ARGB32);
+    quint32 seed = width * 31 + height;
+    for (int y=0; y<height; ++y)
+    {
+        QRgb *line = reinterpret_cast<QRgb*>(src.scanLine(y));
+        for (int x=0; x<width; ++x)
+        {
+            seed = seed * 1103515245 + 12345;
+            line[x] = seed;
+        }
+    }
+
+    // The extreme values.
+    QRgb *first = reinterpret_cast<QRgb*>(src.scanLine(0));
+    first[0] = 0xFFFFFFFF;
+    first[width - 1] = 0x00000000;
+
+    QImage image = src.convertToFormat(QImage::Format(format));
+
+    QImage expected = image;
+    if (expected.format() != QImage::Format_RGB32 &&
+        expected.format() != QImage::Format_ARGB32 &&
+        expected.format() != QImage::Format_ARGB32_Premultiplied)
+    {
+        expected = expected.convertToFormat(expected.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    }
+
+    for (int y=0; y<height; ++y)
+    {
+        QRgb *line = reinterpret_cast<QRgb*>(expected.scanLine(y));
+        for (int x=0; x<width; ++x)
+        {
+            int val = qGray(line[x]);
+            line[x] = qRgba(val, val, val, qAlpha(line[x]));
+        }
+    }
+
+    toGrayscale(&image);
+
+    QCOMPARE(image.format(), expected.format());
+    for (int y=0; y<height; ++y)
+    {
+        const QRgb *res = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+        const QRgb *exp = reinterpret_cast<const QRgb*>(expected.constScanLine(y));
+        for (int x=0; x<width; ++x)
+        {
+            if (res[x] != exp[x])
+            {
+                QFAIL(qPrintable(QString("Pixel %1,%2: %3 instead of %4")
+                                 .arg(x).arg(y)
+                                 .arg(res[x], 8, 16, QChar('0'))
+                                 .arg(exp[x], 8, 16, QChar('0'))));
+            }
+        }
+    }
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_ToGrayscale_data()
+{
+    QTest::addColumn<int>("width");
+    QTest::addColumn<int>("height");
+    QTest::addColumn<int>("format");
+
+    int widths[] = {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 33, 1001};
+    for (uint i=0; i<sizeof(widths) / sizeof(widths[0]); ++i)
+    {
+        QTest::newRow(qPrintable(QString("RGB32 %1").arg(widths[i])))   << widths[i] << 3 << int(QImage::Format_RGB32);
+        QTest::newRow(qPrintable(QString("ARGB32 %1").arg(widths[i])))  << widths[i] << 3 << int(QImage::Format_ARGB32);
+        QTest::newRow(qPrintable(QString("ARGB32P %1").arg(widths[i]))) << widths[i] << 3 << int(QImage::Format_ARGB32_Premultiplied);
+    }
+
+    // Converted to the 32 bit format first.
+    QTest::newRow("RGB888 7")   << 7 << 2 << int(QImage::Format_RGB888);
+    QTest::newRow("RGB16 5")    << 5 << 2 << int(QImage::Format_RGB16);
+}
+
+
+void appendInt(QByteArray *out, qint64 value);
+void appendNum(QByteArray *out, double value, int decimals);
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_TmpPdfAppendInt()
+{
+    QFETCH(qint64,  value);
+    QFETCH(QString, expected);
+
+    QByteArray out = "x";
+    appendInt(&out, value);
+    QVERIFY(out.startsWith('x'));
+    QCOMPARE(out.mid(1), expected.toLatin1());
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_TmpPdfAppendInt_data()
+{
+    QTest::addColumn<qint64>("value");
+    QTest::addColumn<QString>("expected");
+
+    QTest::newRow("01") << qint64(0)                    << "0";
+    QTest::newRow("02") << qint64(7)                    << "7";
+    QTest::newRow("03") << qint64(-7)                   << "-7";
+    QTest::newRow("04") << qint64(10)                   << "10";
+    QTest::newRow("05") << qint64(-1234567890)          << "-1234567890";
+    QTest::newRow("06") << qint64(9999999999LL)         << "9999999999";
+    QTest::newRow("07") << std::numeric_limits<qint64>::max() << "9223372036854775807";
+    QTest::newRow("08") << std::numeric_limits<qint64>::min() << "-9223372036854775808";
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_TmpPdfAppendNum()
+{
+    QFETCH(double,  value);
+    QFETCH(int,     decimals);
+    QFETCH(QString, expected);
+
+    QByteArray out = "x";
+    appendNum(&out, value, decimals);
+    QVERIFY(out.startsWith('x'));
+    QCOMPARE(out.mid(1), expected.toLatin1());
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_TmpPdfAppendNum_data()
+{
+    QTest::addColumn<double>("value");
+    QTest::addColumn<int>("decimals");
+    QTest::addColumn<QString>("expected");
+
+    QTest::newRow("01") <<  0.0      << 3 << "0";
+    QTest::newRow("02") <<  2.0      << 3 << "2";
+    QTest::newRow("03") << -2.0      << 3 << "-2";
+    QTest::newRow("04") <<  1.5      << 3 << "1.5";
+    QTest::newRow("05") << -0.25     << 3 << "-0.25";
+    QTest::newRow("06") <<  10.01    << 3 << "10.01";
+    QTest::newRow("07") <<  0.001    << 3 << "0.001";
+    QTest::newRow("08") <<  123.4567 << 3 << "123.457";
+    QTest::newRow("09") <<  0.9999   << 3 << "1";
+    QTest::newRow("10") <<  0.0004   << 3 << "0";
+    QTest::newRow("11") << -0.0004   << 3 << "0";
+    QTest::newRow("12") <<  595.276  << 3 << "595.276";
+    QTest::newRow("13") << -841.89   << 3 << "-841.89";
+
+    // The matrix terms, see MATRIX_DECIMALS.
+    QTest::newRow("m1") <<  0.70710678 << 6 << "0.707107";
+    QTest::newRow("m2") << -0.70710678 << 6 << "-0.707107";
+    QTest::newRow("m3") <<  0.70710678 << 3 << "0.707";
+    QTest::newRow("m4") <<  1.0 / 3    << 6 << "0.333333";
+    QTest::newRow("m5") <<  0.5        << 6 << "0.5";
+    QTest::newRow("m6") <<  1.0        << 6 << "1";
+    QTest::newRow("m7") <<  0.0000004  << 6 << "0";
+    QTest::newRow("m8") <<  0.000001   << 6 << "0.000001";
+    QTest::newRow("m9") <<  2.5        << 0 << "3";
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+static QByteArray tailObject(int objNum, int version, int size)
+{
+    return QByteArray::number(objNum) + " 0 obj\n(" +
+           QByteArray(size, 'x') + QByteArray::number(version) +
+           ")\nendobj\n";
+}
+
+
+/************************************************
+ * Walks the xref sections from the last one back to the merged
+ * part by /Prev. The entries should point to their objects, the
+ * last ones to the current objects. Returns the error message.
+ * ***********************************************/
+static QString checkTailXRef(const QByteArray &data, qint64 origXRefPos, int firstFreeNum,
+                             const QVector<QByteArray> &objects, int *sections)
+{
+    QSet<int> found;
+    *sections = 0;
+
+    int n = data.lastIndexOf("startxref\n");
+    if (n < 0)
+        return "No startxref";
+
+    qint64 xrefPos = data.mid(n + 10).split('\n').first().toLongLong();
+    while (xrefPos != origXRefPos)
+    {
+        if (++(*sections) > 1000 || xrefPos <= 0 || xrefPos >= data.size())
+            return QString("Broken /Prev chain at %1").arg(xrefPos);
+
+        QList<QByteArray> lines = data.mid(xrefPos).split('\n');
+        if (lines.value(0) != "xref")
+            return QString("No xref at %1").arg(xrefPos);
+
+        int line = 1;
+        while (line < lines.count() && lines.at(line) != "trailer")
+        {
+            QList<QByteArray> header = lines.at(line++).split(' ');
+            int num   = header.value(0).toInt();
+            int count = header.value(1).toInt();
+
+            for (int i=0; i<count; ++i, ++line)
+            {
+                QByteArray entry = lines.value(line);
+                if (entry.length() != 19)
+                    return QString("Bad entry \"%1\"").arg(QString(entry));
+
+                if (entry.at(17) != 'n')
+                    continue;
+
+                qint64 pos = entry.left(10).toLongLong();
+                if (!data.mid(pos).startsWith(QByteArray::number(num + i) + " 0 obj\n"))
+                    return QString("Object %1 is not at %2").arg(num + i).arg(pos);
+
+                if (found.contains(num + i))
+                    continue;
+
+                found << num + i;
+                int idx = num + i - firstFreeNum;
+                if (idx < 0 || idx >= objects.count() || !data.mid(pos).startsWith(objects.at(idx)))
+                    return QString("Object %1 is outdated").arg(num + i);
+            }
+        }
+
+        xrefPos = -1;
+        for (; line < lines.count() && lines.at(line) != "startxref"; ++line)
+        {
+            if (lines.at(line).startsWith("/Prev "))
+                xrefPos = lines.at(line).mid(6).toLongLong();
+        }
+    }
+
+    if (found.count() != objects.count())
+        return QString("Found %1 objects of %2").arg(found.count()).arg(objects.count());
+
+    return "";
+}
+
+
+/************************************************
+ * Each write changes one object, the tail is compacted
+ * into the one section on the compactAt write.
+ * ***********************************************/
+void TestBoomaga::test_TmpPdfTail()
+{
+    QFETCH(int, objectSize);
+    QFETCH(int, compactAt);
+
+    const int firstFreeNum = 10;
+    QByteArray base = "%PDF-1.4\n"
+                      "1 0 obj\n<< >>\nendobj\n";
+    const qint64 origXRefPos = base.size();
+    base += "xref\n"
+            "0 2\n"
+            "0000000000 65535 f \n"
+            "0000000009 00000 n \n"
+            "trailer\n"
+            "<< /Size 10 /Root 1 0 R >>\n"
+            "startxref\n" + QByteArray::number(origXRefPos) + "\n"
+            "%%EOF\n";
+
+    TmpPdfFile tmp;
+    QDir().mkpath(QFileInfo(tmp.fileName()).absolutePath());
+    {
+        QFile file(tmp.fileName());
+        QVERIFY(file.open(QFile::WriteOnly));
+        file.write(base);
+    }
+    tmp.setMergedPart(base.size(), origXRefPos, firstFreeNum);
+
+    QVector<QByteArray> objects;
+    for (int i=0; i<4; ++i)
+        objects << tailObject(firstFreeNum + i, 0, objectSize);
+
+    for (int write=1; write<=compactAt; ++write)
+    {
+        if (write > 1)
+        {
+            int i = write % objects.count();
+            objects[i] = tailObject(firstFreeNum + i, write, objectSize);
+        }
+
+        tmp.writeTail(objects);
+
+        QFile file(tmp.fileName());
+        QVERIFY(file.open(QFile::ReadOnly));
+        QByteArray data = file.readAll();
+        QVERIFY(data.startsWith(base));
+
+        int sections = 0;
+        QString error = checkTailXRef(data, origXRefPos, firstFreeNum, objects, &sections);
+        if (!error.isEmpty())
+            QFAIL(qPrintable(QString("Write %1: %2").arg(write).arg(error)));
+
+        QCOMPARE(sections, write < compactAt ? write : 1);
+    }
+
+    // Nothing is written for the same objects.
+    qint64 size = QFileInfo(tmp.fileName()).size();
+    tmp.writeTail(objects);
+    QCOMPARE(QFileInfo(tmp.fileName()).size(), size);
+
+    // The removed objects are dropped by the compaction.
+    objects.removeLast();
+    tmp.writeTail(objects);
+    {
+        QFile file(tmp.fileName());
+        QVERIFY(file.open(QFile::ReadOnly));
+        QByteArray data = file.readAll();
+
+        int sections = 0;
+        QString error = checkTailXRef(data, origXRefPos, firstFreeNum, objects, &sections);
+        if (!error.isEmpty())
+            QFAIL(qPrintable(QString("Shrink: %1").arg(error)));
+
+        QCOMPARE(sections, 1);
+        QVERIFY(data.contains("/Size " + QByteArray::number(firstFreeNum + objects.count()) + "\n"));
+    }
+}
+
+
+/************************************************
+ *
+ * ***********************************************/
+void TestBoomaga::test_TmpPdfTail_data()
+{
+    QTest::addColumn<int>("objectSize");
+    QTest::addColumn<int>("compactAt");
+
+    // MAX_TAIL_SECTIONS sections are appended.
+    QTest::newRow("sections") << 16 << 65;
+
+    // The appended sections outgrow MAX_TAIL_GROWTH compacted tails,
+    // 4 MB of the objects, 1 MB per section.
+    QTest::newRow("growth")   << 1024 * 1024 << 14;
+}
+
 /************************************************
  *
  * ***********************************************/
@@ -63,6 +63,28 @@ private slots:
     void test_BooklesSplit();
     void test_BooklesSplit_data();
 
+    void test_SheetIsSame();
+
+    void test_ImageCacheReplace();
+    void test_ImageCacheReplace_data();
+
+    void test_ImageCacheKey();
+
+    void test_ImageCacheCost();
+    void test_ImageCacheCost_data();
+
+    void test_ToGrayscale();
+    void test_ToGrayscale_data();
+
+    void test_TmpPdfAppendInt();
+    void test_TmpPdfAppendInt_data();
+
+    void test_TmpPdfAppendNum();
+    void test_TmpPdfAppendNum_data();
+
+    void test_TmpPdfTail();
+    void test_TmpPdfTail_data();
+
     void testPdfArray();
 
     void testPdfBool();
@@ -102,6 +124,9 @@ private slots:
     void testPdfReader_ReadStringLiteral();
     void testPdfReader_ReadStringLiteral_data();
 
+    void testPdfReader_Shared();
+    void testPdfReader_Shared_data();
+
     // PDF::Reader ........................................
 
     // PDF::Writer ........................................
@@ -27,6 +27,10 @@
 #include "testboomaga.h"
 
 #include <QTest>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QSharedPointer>
 #include "../pdfparser/pdfreader.h"
 #include "tools.h"
 
@@ -473,3 +477,128 @@ void TestBoomaga::testPdfReader_ReadStringLiteral_data()
             << "(These \\(two (\\(strings are) \\(the \\)same.)Not string"
             << "These (two ((strings are) (the )same.";
 }
+
+
+/************************************************
+ * The empty document, the comment changes the file size.
+ ************************************************/
+static QByteArray emptyPdf(const QByteArray &comment)
+{
+    QByteArray res = "%PDF-1.4\n%" + comment + "\n";
+
+    int obj1Pos = res.size();
+    res.append("1 0 obj <</Type /Catalog /Pages 2 0 R>> endobj\n");
+
+    int obj2Pos = res.size();
+    res.append("2 0 obj <</Type /Pages /Kids [ ] /Count 0>>endobj\n");
+
+    int xrefPos = res.size();
+    res.append("xref\n");
+    res.append("0 3\n");
+    res.append("0000000000 65535 f \n");
+    res.append(QString("%1 00000 n \n").arg(obj1Pos, 10, 10, QChar('0')).toLatin1());
+    res.append(QString("%1 00000 n \n").arg(obj2Pos, 10, 10, QChar('0')).toLatin1());
+
+    res.append("trailer\n<</Root 1 0 R /Size 3>>\n");
+    res.append(QString("startxref\n%1\n%%EOF\n").arg(xrefPos).toLatin1());
+    return res;
+}
+
+
+/************************************************
+ * The ops are the file numbers to get the shared reader
+ * for, "r<N>" releases the file, "m<N>" modifies it.
+ * The expected is "n" for the new reader and "s" for the
+ * reader returned before, "-" for the other ops.
+ ************************************************/
+void TestBoomaga::testPdfReader_Shared()
+{
+    QFETCH(QString, ops);
+    QFETCH(QString, expected);
+
+    const int fileCount = 20;
+    QString path = dir();
+    QDir().mkpath(path);
+
+    QStringList files;
+    for (int i=0; i<fileCount; ++i)
+    {
+        QString fileName = QString("%1/%2.pdf").arg(path).arg(i);
+        QFile file(fileName);
+        QVERIFY(file.open(QFile::WriteOnly | QFile::Truncate));
+        file.write(emptyPdf("file"));
+        files << fileName;
+        PDF::Reader::releaseShared(fileName);
+    }
+
+    // The old readers are kept, so the new one can't get the same address.
+    QList<QSharedPointer<PDF::Reader> > keep;
+    QHash<int, PDF::Reader*> last;
+    QStringList result;
+
+    foreach (const QString &op, ops.split(" ", QString::SkipEmptyParts))
+    {
+        if (op.startsWith("r"))
+        {
+            PDF::Reader::releaseShared(files.at(op.mid(1).toInt()));
+            result << "-";
+            continue;
+        }
+
+        if (op.startsWith("m"))
+        {
+            QFile file(files.at(op.mid(1).toInt()));
+            QVERIFY(file.open(QFile::WriteOnly | QFile::Truncate));
+            file.write(emptyPdf("modified file"));
+            result << "-";
+            continue;
+        }
+
+        int n = op.toInt();
+        QSharedPointer<PDF::Reader> reader = PDF::Reader::shared(files.at(n));
+        QVERIFY(reader);
+        keep << reader;
+
+        result << (last.value(n) == reader.data() ? "s" : "n");
+        last[n] = reader.data();
+    }
+
+    foreach (const QString &fileName, files)
+        PDF::Reader::releaseShared(fileName);
+
+    QCOMPARE(result.join(" "), expected.simplified());
+}
+
+
+/************************************************
+ * MAX_SHARED_READERS is 16.
+ ************************************************/
+void TestBoomaga::testPdfReader_Shared_data()
+{
+    QTest::addColumn<QString>("ops");
+    QTest::addColumn<QString>("expected");
+
+    QTest::newRow("same")
+            << "0 0 1 0 1"
+            << "n s n s s";
+
+    QTest::newRow("full")
+            << "0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15  0 15"
+            << "n n n n n n n n n n n  n  n  n  n  n   s s";
+
+    QTest::newRow("least recently used evicted")
+            << "0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15  16  1 0"
+            << "n n n n n n n n n n n  n  n  n  n  n   n   s n";
+
+    QTest::newRow("used reader kept")
+            << "0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15  0 16  0 1"
+            << "n n n n n n n n n n n  n  n  n  n  n   s n   s n";
+
+    QTest::newRow("released")
+            << "0 1 r0 0 1"
+            << "n n -  n s";
+
+    QTest::newRow("modified")
+            << "0 1 m0 0 1"
+            << "n n -  n s";
+}